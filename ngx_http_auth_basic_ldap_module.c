@@ -1,5 +1,56 @@
 #include <openldap.h>
 #include <ngx_http.h>
+#include <ngx_md5.h>
+
+#define NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN 16
+#define NGX_HTTP_AUTH_BASIC_LDAP_EWMA_SCALE 16
+#define NGX_HTTP_AUTH_BASIC_LDAP_ATTR_LEN 256
+
+#define NGX_HTTP_AUTH_BASIC_LDAP_STALE_ERROR 0x00000002
+#define NGX_HTTP_AUTH_BASIC_LDAP_STALE_TIMEOUT 0x00000004
+#define NGX_HTTP_AUTH_BASIC_LDAP_STALE_UPDATING 0x00000008
+#define NGX_HTTP_AUTH_BASIC_LDAP_STALE_OFF 0x00000010
+
+#define NGX_HTTP_AUTH_BASIC_LDAP_CONNECT 0
+#define NGX_HTTP_AUTH_BASIC_LDAP_BIND 1
+#define NGX_HTTP_AUTH_BASIC_LDAP_SEARCH 2
+#define NGX_HTTP_AUTH_BASIC_LDAP_PHASES 3
+
+#define NGX_HTTP_AUTH_BASIC_LDAP_BIND_RESPONSES 0
+#define NGX_HTTP_AUTH_BASIC_LDAP_SEARCH_ENTRIES 1
+#define NGX_HTTP_AUTH_BASIC_LDAP_SEARCH_REFERENCES 2
+#define NGX_HTTP_AUTH_BASIC_LDAP_SEARCH_RESULTS 3
+#define NGX_HTTP_AUTH_BASIC_LDAP_OTHER_RESPONSES 4
+#define NGX_HTTP_AUTH_BASIC_LDAP_SUCCESS 5
+#define NGX_HTTP_AUTH_BASIC_LDAP_INVALID_CREDENTIALS 6
+#define NGX_HTTP_AUTH_BASIC_LDAP_ERRORS 7
+#define NGX_HTTP_AUTH_BASIC_LDAP_FAILURES 8
+#define NGX_HTTP_AUTH_BASIC_LDAP_BYTES 9
+#define NGX_HTTP_AUTH_BASIC_LDAP_COUNTERS 10
+
+#define NGX_HTTP_AUTH_BASIC_LDAP_BUCKETS 12
+
+#define NGX_HTTP_AUTH_BASIC_LDAP_STATUS_JSON 1
+#define NGX_HTTP_AUTH_BASIC_LDAP_STATUS_PROMETHEUS 2
+#define NGX_HTTP_AUTH_BASIC_LDAP_STATUS_LEN 16384
+
+#define NGX_HTTP_AUTH_BASIC_LDAP_CACHE_MISS 1
+#define NGX_HTTP_AUTH_BASIC_LDAP_CACHE_HIT 2
+#define NGX_HTTP_AUTH_BASIC_LDAP_CACHE_EXPIRED 3
+#define NGX_HTTP_AUTH_BASIC_LDAP_CACHE_STALE 4
+#define NGX_HTTP_AUTH_BASIC_LDAP_CACHE_UPDATING 5
+
+#define NGX_HTTP_AUTH_BASIC_LDAP_SYNC_SYNCREPL 1
+#define NGX_HTTP_AUTH_BASIC_LDAP_SYNC_PSEARCH 2
+#define NGX_HTTP_AUTH_BASIC_LDAP_SYNC_DIRSYNC 3
+
+#define NGX_HTTP_AUTH_BASIC_LDAP_PSEARCH_CHANGES 15
+#define NGX_HTTP_AUTH_BASIC_LDAP_DIRSYNC "1.2.840.113556.1.4.841"
+#define NGX_HTTP_AUTH_BASIC_LDAP_DIRSYNC_INCREMENTAL_VALUES ((ber_int_t)0x80000000)
+#define NGX_HTTP_AUTH_BASIC_LDAP_DIRSYNC_MAX_BYTES 1048576
+
+#define NGX_HTTP_AUTH_BASIC_LDAP_DN_LEN 1024
+#define NGX_HTTP_AUTH_BASIC_LDAP_IN_CHAIN "1.2.840.113556.1.4.1941"
 
 typedef struct {
     ngx_str_t attr;
@@ -9,26 +60,360 @@ typedef struct {
 #endif
 } ngx_http_auth_basic_ldap_attr_t;
 
+typedef struct {
+    ngx_http_auth_basic_ldap_attr_t *attr;
+    ngx_str_t key;
+    u_char *lowcase_key;
+    ngx_uint_t hash;
+} ngx_http_auth_basic_ldap_rule_t;
+
+typedef struct {
+    uint32_t *groups;
+    ngx_uint_t ngroups;
+} ngx_http_auth_basic_ldap_require_t;
+
+typedef struct ngx_http_auth_basic_ldap_sync_s ngx_http_auth_basic_ldap_sync_t;
+
 typedef struct {
     ngx_array_t *attrs;
+    ngx_hash_t rules;
+    ngx_str_t attr_separator;
     ngx_http_complex_value_t *bind;
+    ngx_msec_t bind_timeout;
+    ngx_msec_t connect_timeout;
+    ngx_msec_t search_timeout;
+    ngx_uint_t tries;
+    ngx_shm_zone_t *cache;
+    time_t cache_invalid;
+    time_t cache_stale;
+    time_t cache_valid;
+    ngx_uint_t cache_use_stale;
+    ngx_flag_t cache_background_update;
+    ngx_http_auth_basic_ldap_sync_t *cache_sync;
     ngx_http_complex_value_t *header;
+    ngx_flag_t headers;
     ngx_http_complex_value_t *realm;
     ngx_http_complex_value_t *url;
+    LDAPURLDesc *lud;
+    ngx_addr_t *addrs;
+    ngx_uint_t naddrs;
+    ngx_str_t domain;
+    ngx_shm_zone_t *servers;
+    ngx_uint_t max_fails;
+    time_t fail_timeout;
+    ngx_str_t service_bind;
+    ngx_str_t service_password;
+    ngx_flag_t coalesce;
+    ngx_uint_t status;
+    ngx_shm_zone_t *fail_limit;
+    ngx_uint_t fail_rate;
+    ngx_uint_t fail_burst;
+    ngx_uint_t fail_status;
+    ngx_array_t *require;
+    ngx_flag_t nested_groups;
+#if (NGX_SSL)
+    ngx_ssl_t *ssl;
+    ngx_str_t ssl_name;
+    ngx_str_t ssl_trusted_certificate;
+    ngx_flag_t ssl_server_name;
+    ngx_flag_t ssl_session_reuse;
+    ngx_flag_t ssl_verify;
+    ngx_uint_t ssl_verify_depth;
+    ngx_flag_t starttls;
+#endif
 } ngx_http_auth_basic_ldap_location_conf_t;
 
+typedef struct {
+    ngx_rbtree_node_t node;
+    void *cache_node;
+} ngx_http_auth_basic_ldap_cache_link_t;
+
+typedef struct {
+    u_char color;
+    u_char dummy;
+    u_short rc;
+    uint32_t dn_hash;
+    uint32_t generation;
+    uint32_t ngroups;
+    ngx_http_auth_basic_ldap_cache_link_t dn_link;
+    ngx_queue_t queue;
+    time_t expire;
+    time_t stale;
+    time_t updating;
+    ngx_uint_t nelts;
+    size_t size;
+    u_char key[NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN];
+    u_char data[1];
+} ngx_http_auth_basic_ldap_cache_node_t;
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_rbtree_t dn_rbtree;
+    ngx_rbtree_node_t dn_sentinel;
+    ngx_rbtree_t group_rbtree;
+    ngx_rbtree_node_t group_sentinel;
+    ngx_queue_t queue;
+    u_char secret[NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN];
+} ngx_http_auth_basic_ldap_cache_shctx_t;
+
+typedef struct {
+    ngx_http_auth_basic_ldap_cache_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+} ngx_http_auth_basic_ldap_cache_t;
+
+typedef struct {
+    u_char color;
+    u_char probe;
+    u_short socklen;
+    ngx_uint_t outstanding;
+    ngx_uint_t fails;
+    ngx_msec_t ewma;
+    time_t checked;
+    ngx_uint_t counters[NGX_HTTP_AUTH_BASIC_LDAP_COUNTERS];
+    ngx_uint_t buckets[NGX_HTTP_AUTH_BASIC_LDAP_PHASES][NGX_HTTP_AUTH_BASIC_LDAP_BUCKETS];
+    ngx_msec_t sum[NGX_HTTP_AUTH_BASIC_LDAP_PHASES];
+#if (NGX_SSL)
+    u_char *ssl_session;
+    size_t ssl_session_len;
+#endif
+    u_char sockaddr[1];
+} ngx_http_auth_basic_ldap_servers_node_t;
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+} ngx_http_auth_basic_ldap_servers_shctx_t;
+
+typedef struct {
+    ngx_http_auth_basic_ldap_servers_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+} ngx_http_auth_basic_ldap_servers_t;
+
+typedef struct {
+    u_char color;
+    u_char dummy;
+    u_short dummy2;
+    ngx_queue_t queue;
+    ngx_msec_t last;
+    ngx_uint_t excess;
+    u_char key[NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN];
+} ngx_http_auth_basic_ldap_fail_node_t;
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue;
+    u_char secret[NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN];
+} ngx_http_auth_basic_ldap_fail_shctx_t;
+
+typedef struct {
+    ngx_http_auth_basic_ldap_fail_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+} ngx_http_auth_basic_ldap_fail_t;
+
+struct ngx_http_auth_basic_ldap_sync_s {
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf;
+    ngx_shm_zone_t *cache;
+    LDAPURLDesc *lud;
+    ngx_addr_t *addrs;
+    ngx_uint_t naddrs;
+    ngx_uint_t addr;
+    ngx_uint_t mode;
+    ngx_msec_t interval;
+    ngx_peer_connection_t peer_connection;
+    ngx_event_t event;
+    LDAP *ldap;
+    struct berval cookie;
+#if (NGX_SSL)
+    ngx_ssl_t *ssl;
+    ngx_str_t ssl_name;
+    unsigned starttls:1;
+#endif
+    int msgid;
+    unsigned bound:1;
+    unsigned refreshed:1;
+};
+
+typedef struct {
+    ngx_queue_t cache;
+    ngx_queue_t free;
+    ngx_queue_t service;
+    ngx_array_t syncs;
+    ngx_array_t groups;
+    ngx_hash_t group_hash;
+    uint32_t generation;
+    ngx_rbtree_t flights;
+    ngx_rbtree_node_t sentinel;
+    u_char secret[NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN];
+    ngx_msec_t keepalive_timeout;
+    ngx_uint_t keepalive;
+    ngx_uint_t service_connections;
+} ngx_http_auth_basic_ldap_main_conf_t;
+
+typedef struct {
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf;
+    ngx_queue_t queue;
+    ngx_connection_t *connection;
+    LDAP *ldap;
+#if (NGX_SSL)
+    ngx_ssl_t *ssl;
+#endif
+    socklen_t socklen;
+    u_char sockaddr[NGX_SOCKADDRLEN];
+} ngx_http_auth_basic_ldap_keepalive_t;
+
+typedef struct {
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf;
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf;
+    ngx_queue_t queue;
+    ngx_queue_t waiting;
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_peer_connection_t peer_connection;
+    LDAP *ldap;
+    ngx_str_t bind;
+    ngx_str_t password;
+    ngx_str_t name;
+    ngx_uint_t requests;
+    ngx_msec_t bind_timeout;
+#if (NGX_SSL)
+    ngx_ssl_t *ssl;
+    ngx_str_t ssl_name;
+    unsigned starttls:1;
+#endif
+    int msgid;
+    unsigned bound:1;
+    u_char sockaddr[NGX_SOCKADDRLEN];
+} ngx_http_auth_basic_ldap_service_t;
+
 typedef struct {
     int msgid;
     LDAP *ldap;
     LDAPMessage *result;
+    LDAPMessage *entry;
     LDAPURLDesc *lud;
     ngx_int_t rc;
     ngx_peer_connection_t peer_connection;
     ngx_str_t realm;
+    ngx_array_t *attrs;
+    ngx_int_t stale_rc;
+    ngx_array_t *stale_attrs;
+    ngx_array_t *groups;
+    ngx_array_t *stale_groups;
+    ngx_addr_t *addrs;
+    ngx_uint_t naddrs;
+    ngx_uint_t addr;
+    ngx_uint_t tries;
+    uintptr_t *tried;
+    ngx_http_auth_basic_ldap_servers_t *servers;
+    ngx_http_auth_basic_ldap_servers_node_t *server;
+    ngx_msec_t start;
+    ngx_msec_t phase;
+    ngx_msec_t begin;
+    ngx_msec_t time;
+    ngx_msec_t times[NGX_HTTP_AUTH_BASIC_LDAP_PHASES];
+    ngx_uint_t counters[NGX_HTTP_AUTH_BASIC_LDAP_COUNTERS];
+    ngx_uint_t cache_status;
+    ngx_event_t event;
+    ngx_resolver_ctx_t *resolver;
+    ngx_http_auth_basic_ldap_service_t *service;
+    ngx_http_request_t *request;
+    ngx_pool_cleanup_t *cleanup;
+    ngx_queue_t queue;
+    ngx_rbtree_node_t node;
+    ngx_str_t dn;
+    uint32_t dn_hash;
+    ngx_rbtree_node_t flight;
+    ngx_queue_t followers;
+    ngx_queue_t follower;
+    void *leader;
+#if (NGX_SSL)
+    ngx_ssl_t *ssl;
+#endif
+    u_char key[NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN];
+    unsigned cacheable:1;
+    unsigned keepalive:1;
+    unsigned waiting:1;
+    unsigned lud_static:1;
+    unsigned resolving:1;
+    unsigned probe:1;
+    unsigned leading:1;
+    unsigned stale:1;
+    unsigned background:1;
+    unsigned nesting:1;
+    unsigned responded:1;
+#if (NGX_SSL)
+    unsigned starttls:1;
+#endif
+    unsigned timed:NGX_HTTP_AUTH_BASIC_LDAP_PHASES;
 } ngx_http_auth_basic_ldap_context_t;
 
 ngx_module_t ngx_http_auth_basic_ldap_module;
 
+static void ngx_http_auth_basic_ldap_release(ngx_http_auth_basic_ldap_context_t *context);
+static ngx_int_t ngx_http_auth_basic_ldap_start(ngx_http_request_t *r);
+static void ngx_http_auth_basic_ldap_retry(ngx_http_request_t *r, ngx_int_t rc);
+static void ngx_http_auth_basic_ldap_write_handler(ngx_event_t *ev);
+static void ngx_http_auth_basic_ldap_service_read_handler(ngx_event_t *ev);
+static void ngx_http_auth_basic_ldap_service_write_handler(ngx_event_t *ev);
+static void ngx_http_auth_basic_ldap_sync_read_handler(ngx_event_t *ev);
+static void ngx_http_auth_basic_ldap_sync_write_handler(ngx_event_t *ev);
+#if (NGX_SSL)
+static void ngx_http_auth_basic_ldap_ssl_handshake(ngx_http_request_t *r);
+#endif
+
+static ngx_conf_bitmask_t ngx_http_auth_basic_ldap_cache_use_stale_masks[] = {
+  { ngx_string("error"), NGX_HTTP_AUTH_BASIC_LDAP_STALE_ERROR },
+  { ngx_string("timeout"), NGX_HTTP_AUTH_BASIC_LDAP_STALE_TIMEOUT },
+  { ngx_string("updating"), NGX_HTTP_AUTH_BASIC_LDAP_STALE_UPDATING },
+  { ngx_string("off"), NGX_HTTP_AUTH_BASIC_LDAP_STALE_OFF },
+  { ngx_null_string, 0 }
+};
+
+static ngx_conf_enum_t ngx_http_auth_basic_ldap_status_formats[] = {
+  { ngx_string("json"), NGX_HTTP_AUTH_BASIC_LDAP_STATUS_JSON },
+  { ngx_string("prometheus"), NGX_HTTP_AUTH_BASIC_LDAP_STATUS_PROMETHEUS },
+  { ngx_null_string, 0 }
+};
+
+static ngx_conf_enum_t ngx_http_auth_basic_ldap_cache_sync_modes[] = {
+  { ngx_string("syncrepl"), NGX_HTTP_AUTH_BASIC_LDAP_SYNC_SYNCREPL },
+  { ngx_string("psearch"), NGX_HTTP_AUTH_BASIC_LDAP_SYNC_PSEARCH },
+  { ngx_string("dirsync"), NGX_HTTP_AUTH_BASIC_LDAP_SYNC_DIRSYNC },
+  { ngx_null_string, 0 }
+};
+
+static ngx_str_t ngx_http_auth_basic_ldap_phases[] = {
+    ngx_string("connect"),
+    ngx_string("bind"),
+    ngx_string("search")
+};
+
+static ngx_str_t ngx_http_auth_basic_ldap_counters[] = {
+    ngx_string("bind_responses"),
+    ngx_string("search_entries"),
+    ngx_string("search_references"),
+    ngx_string("search_results"),
+    ngx_string("other_responses"),
+    ngx_string("success"),
+    ngx_string("invalid_credentials"),
+    ngx_string("errors"),
+    ngx_string("failures"),
+    ngx_string("bytes")
+};
+
+static ngx_msec_t ngx_http_auth_basic_ldap_buckets[NGX_HTTP_AUTH_BASIC_LDAP_BUCKETS - 1] = {1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000};
+
+static ngx_str_t ngx_http_auth_basic_ldap_cache_statuses[] = {
+    ngx_null_string,
+    ngx_string("MISS"),
+    ngx_string("HIT"),
+    ngx_string("EXPIRED"),
+    ngx_string("STALE"),
+    ngx_string("UPDATING")
+};
+
 static char *ngx_http_auth_basic_ldap_attr_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
     ngx_http_auth_basic_ldap_location_conf_t *location_conf = conf;
     if (location_conf->attrs == NGX_CONF_UNSET_PTR && !(location_conf->attrs = ngx_array_create(cf->pool, 4, sizeof(ngx_http_auth_basic_ldap_attr_t)))) return "!ngx_array_create";
@@ -57,6 +442,492 @@ static char *ngx_http_auth_basic_ldap_attr_conf(ngx_conf_t *cf, ngx_command_t *c
     return NGX_CONF_OK;
 }
 
+static void ngx_http_auth_basic_ldap_secret(u_char *secret) {
+#if (NGX_SSL)
+    if (RAND_bytes(secret, NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN) == 1) return;
+#endif
+    for (ngx_uint_t i = 0; i < NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN; i += sizeof(uint32_t)) { uint32_t n = (uint32_t)ngx_random(); ngx_memcpy(&secret[i], &n, sizeof(uint32_t)); }
+}
+
+static void ngx_http_auth_basic_ldap_hmac_init(ngx_md5_t *md5, u_char *secret) {
+    u_char pad[64];
+    ngx_memzero(pad, sizeof(pad));
+    ngx_memcpy(pad, secret, NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN);
+    for (ngx_uint_t i = 0; i < sizeof(pad); i++) pad[i] ^= 0x36;
+    ngx_md5_init(md5);
+    ngx_md5_update(md5, pad, sizeof(pad));
+}
+
+static void ngx_http_auth_basic_ldap_hmac_final(ngx_md5_t *md5, u_char *secret, u_char *key) {
+    u_char pad[64], digest[16];
+    ngx_md5_final(digest, md5);
+    ngx_memzero(pad, sizeof(pad));
+    ngx_memcpy(pad, secret, NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN);
+    for (ngx_uint_t i = 0; i < sizeof(pad); i++) pad[i] ^= 0x5c;
+    ngx_md5_init(md5);
+    ngx_md5_update(md5, pad, sizeof(pad));
+    ngx_md5_update(md5, digest, sizeof(digest));
+    ngx_md5_final(key, md5);
+}
+
+static void ngx_http_auth_basic_ldap_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+    ngx_rbtree_node_t **p;
+    for (;;) {
+        if (node->key < temp->key) p = &temp->left;
+        else if (node->key > temp->key) p = &temp->right;
+        else p = ngx_memcmp(((ngx_http_auth_basic_ldap_cache_node_t *)&node->color)->key, ((ngx_http_auth_basic_ldap_cache_node_t *)&temp->color)->key, NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN) < 0 ? &temp->left : &temp->right;
+        if (*p == sentinel) break;
+        temp = *p;
+    }
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_auth_basic_ldap_cache_t *ocache = data;
+    ngx_http_auth_basic_ldap_cache_t *cache = shm_zone->data;
+    if (ocache) { cache->sh = ocache->sh; cache->shpool = ocache->shpool; return NGX_OK; }
+    cache->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    if (shm_zone->shm.exists) { cache->sh = cache->shpool->data; return NGX_OK; }
+    if (!(cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_auth_basic_ldap_cache_shctx_t)))) return NGX_ERROR;
+    cache->shpool->data = cache->sh;
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel, ngx_http_auth_basic_ldap_rbtree_insert_value);
+    ngx_rbtree_init(&cache->sh->dn_rbtree, &cache->sh->dn_sentinel, ngx_rbtree_insert_value);
+    ngx_rbtree_init(&cache->sh->group_rbtree, &cache->sh->group_sentinel, ngx_rbtree_insert_value);
+    ngx_queue_init(&cache->sh->queue);
+    ngx_http_auth_basic_ldap_secret(cache->sh->secret);
+    size_t len = sizeof(" in auth_basic_ldap_cache zone \"\"") + shm_zone->shm.name.len;
+    if (!(cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len))) return NGX_ERROR;
+    ngx_sprintf(cache->shpool->log_ctx, " in auth_basic_ldap_cache zone \"%V\"%Z", &shm_zone->shm.name);
+    cache->shpool->log_nomem = 0;
+    return NGX_OK;
+}
+
+static char *ngx_http_auth_basic_ldap_cache_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = conf;
+    if (location_conf->cache != NGX_CONF_UNSET_PTR) return "is duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    if (cf->args->nelts == 2 && elts[1].len == sizeof("off") - 1 && !ngx_strncmp(elts[1].data, "off", sizeof("off") - 1)) { location_conf->cache = NULL; return NGX_CONF_OK; }
+    ngx_str_t name = ngx_null_string;
+    ssize_t size = 0;
+    location_conf->cache_invalid = 0;
+    location_conf->cache_stale = 0;
+    location_conf->cache_valid = 60;
+    for (ngx_uint_t i = 1; i < cf->args->nelts; i++) {
+        if (elts[i].len > sizeof("zone=") - 1 && !ngx_strncmp(elts[i].data, "zone=", sizeof("zone=") - 1)) {
+            name.data = elts[i].data + sizeof("zone=") - 1;
+            name.len = elts[i].len - (sizeof("zone=") - 1);
+            u_char *p = ngx_strlchr(name.data, name.data + name.len, ':');
+            if (!p) continue;
+            ngx_str_t s = {name.data + name.len - p - 1, p + 1};
+            name.len = p - name.data;
+            if ((size = ngx_parse_size(&s)) == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &elts[i]); return NGX_CONF_ERROR; }
+            if (size < (ssize_t)(8 * ngx_pagesize)) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small", &elts[i]); return NGX_CONF_ERROR; }
+            continue;
+        }
+        if (elts[i].len > sizeof("valid=") - 1 && !ngx_strncmp(elts[i].data, "valid=", sizeof("valid=") - 1)) {
+            ngx_str_t s = {elts[i].len - (sizeof("valid=") - 1), elts[i].data + sizeof("valid=") - 1};
+            if ((location_conf->cache_valid = ngx_parse_time(&s, 1)) == (time_t)NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &elts[i]); return NGX_CONF_ERROR; }
+            continue;
+        }
+        if (elts[i].len > sizeof("stale=") - 1 && !ngx_strncmp(elts[i].data, "stale=", sizeof("stale=") - 1)) {
+            ngx_str_t s = {elts[i].len - (sizeof("stale=") - 1), elts[i].data + sizeof("stale=") - 1};
+            if ((location_conf->cache_stale = ngx_parse_time(&s, 1)) == (time_t)NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &elts[i]); return NGX_CONF_ERROR; }
+            continue;
+        }
+        if (elts[i].len > sizeof("invalid=") - 1 && !ngx_strncmp(elts[i].data, "invalid=", sizeof("invalid=") - 1)) {
+            ngx_str_t s = {elts[i].len - (sizeof("invalid=") - 1), elts[i].data + sizeof("invalid=") - 1};
+            if ((location_conf->cache_invalid = ngx_parse_time(&s, 1)) == (time_t)NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &elts[i]); return NGX_CONF_ERROR; }
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &elts[i]);
+        return NGX_CONF_ERROR;
+    }
+    if (!name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" must have \"zone\" parameter", &cmd->name); return NGX_CONF_ERROR; }
+    if (!(location_conf->cache = ngx_shared_memory_add(cf, &name, size, cmd))) return "!ngx_shared_memory_add";
+    if (location_conf->cache->data) return NGX_CONF_OK;
+    ngx_http_auth_basic_ldap_cache_t *cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_basic_ldap_cache_t));
+    if (!cache) return "!ngx_pcalloc";
+    location_conf->cache->init = ngx_http_auth_basic_ldap_cache_init_zone;
+    location_conf->cache->data = cache;
+    return NGX_CONF_OK;
+}
+
+static void ngx_http_auth_basic_ldap_url_cleanup(void *data) {
+    ldap_free_urldesc(data);
+}
+
+static char *ngx_http_auth_basic_ldap_cache_sync_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = conf;
+    if (location_conf->cache_sync != NGX_CONF_UNSET_PTR) return "is duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    if (cf->args->nelts == 2 && elts[1].len == sizeof("off") - 1 && !ngx_strncmp(elts[1].data, "off", sizeof("off") - 1)) { location_conf->cache_sync = NULL; return NGX_CONF_OK; }
+    ngx_http_auth_basic_ldap_sync_t *sync = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_basic_ldap_sync_t));
+    if (!sync) return "!ngx_pcalloc";
+    sync->mode = NGX_HTTP_AUTH_BASIC_LDAP_SYNC_SYNCREPL;
+    sync->interval = 10000;
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        if (elts[i].len > sizeof("mode=") - 1 && !ngx_strncmp(elts[i].data, "mode=", sizeof("mode=") - 1)) {
+            ngx_str_t s = {elts[i].len - (sizeof("mode=") - 1), elts[i].data + sizeof("mode=") - 1};
+            ngx_conf_enum_t *e;
+            for (e = ngx_http_auth_basic_ldap_cache_sync_modes; e->name.len; e++) if (e->name.len == s.len && !ngx_strncasecmp(e->name.data, s.data, s.len)) break;
+            if (!e->name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &elts[i]); return NGX_CONF_ERROR; }
+            sync->mode = e->value;
+            continue;
+        }
+        if (elts[i].len > sizeof("interval=") - 1 && !ngx_strncmp(elts[i].data, "interval=", sizeof("interval=") - 1)) {
+            ngx_str_t s = {elts[i].len - (sizeof("interval=") - 1), elts[i].data + sizeof("interval=") - 1};
+            if ((sync->interval = ngx_parse_time(&s, 0)) == (ngx_msec_t)NGX_ERROR || !sync->interval) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &elts[i]); return NGX_CONF_ERROR; }
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &elts[i]);
+        return NGX_CONF_ERROR;
+    }
+    LDAPURLDesc *lud;
+    int rc = ldap_url_parse((const char *)elts[1].data, &lud);
+    if (rc != LDAP_SUCCESS) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "ldap_url_parse failed: %s", ldap_err2string(rc)); return NGX_CONF_ERROR; }
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (!cln) { ldap_free_urldesc(lud); return "!ngx_pool_cleanup_add"; }
+    cln->handler = ngx_http_auth_basic_ldap_url_cleanup;
+    cln->data = lud;
+    if (!lud->lud_host || !lud->lud_dn || !*lud->lud_dn) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" must have host and base dn in url", &cmd->name); return NGX_CONF_ERROR; }
+    ngx_url_t ngx_url;
+    ngx_memzero(&ngx_url, sizeof(ngx_url_t));
+    ngx_url.url.data = (u_char *)lud->lud_host;
+    ngx_url.url.len = ngx_strlen(lud->lud_host);
+    ngx_url.default_port = lud->lud_port;
+    if (ngx_parse_url(cf->pool, &ngx_url) != NGX_OK) {
+        if (ngx_url.err) ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%s in LDAP hostname \"%V\"", ngx_url.err, &ngx_url.url);
+        return NGX_CONF_ERROR;
+    }
+    sync->lud = lud;
+    sync->addrs = ngx_url.addrs;
+    sync->naddrs = ngx_url.naddrs;
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_sync_t **syncs = ngx_array_push(&main_conf->syncs);
+    if (!syncs) return "!ngx_array_push";
+    *syncs = sync;
+    location_conf->cache_sync = sync;
+    return NGX_CONF_OK;
+}
+
+static void ngx_http_auth_basic_ldap_servers_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+    ngx_rbtree_node_t **p;
+    for (;;) {
+        if (node->key < temp->key) p = &temp->left;
+        else if (node->key > temp->key) p = &temp->right;
+        else {
+            ngx_http_auth_basic_ldap_servers_node_t *n = (ngx_http_auth_basic_ldap_servers_node_t *)&node->color;
+            ngx_http_auth_basic_ldap_servers_node_t *t = (ngx_http_auth_basic_ldap_servers_node_t *)&temp->color;
+            p = ngx_memn2cmp(n->sockaddr, t->sockaddr, n->socklen, t->socklen) < 0 ? &temp->left : &temp->right;
+        }
+        if (*p == sentinel) break;
+        temp = *p;
+    }
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_servers_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_auth_basic_ldap_servers_t *oservers = data;
+    ngx_http_auth_basic_ldap_servers_t *servers = shm_zone->data;
+    if (oservers) { servers->sh = oservers->sh; servers->shpool = oservers->shpool; return NGX_OK; }
+    servers->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    if (shm_zone->shm.exists) { servers->sh = servers->shpool->data; return NGX_OK; }
+    if (!(servers->sh = ngx_slab_alloc(servers->shpool, sizeof(ngx_http_auth_basic_ldap_servers_shctx_t)))) return NGX_ERROR;
+    servers->shpool->data = servers->sh;
+    ngx_rbtree_init(&servers->sh->rbtree, &servers->sh->sentinel, ngx_http_auth_basic_ldap_servers_rbtree_insert_value);
+    size_t len = sizeof(" in auth_basic_ldap_servers zone \"\"") + shm_zone->shm.name.len;
+    if (!(servers->shpool->log_ctx = ngx_slab_alloc(servers->shpool, len))) return NGX_ERROR;
+    ngx_sprintf(servers->shpool->log_ctx, " in auth_basic_ldap_servers zone \"%V\"%Z", &shm_zone->shm.name);
+    return NGX_OK;
+}
+
+static char *ngx_http_auth_basic_ldap_servers_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = conf;
+    if (location_conf->servers != NGX_CONF_UNSET_PTR) return "is duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    if (cf->args->nelts == 2 && elts[1].len == sizeof("off") - 1 && !ngx_strncmp(elts[1].data, "off", sizeof("off") - 1)) { location_conf->servers = NULL; return NGX_CONF_OK; }
+    ngx_str_t name = ngx_null_string;
+    ssize_t size = 0;
+    location_conf->max_fails = 1;
+    location_conf->fail_timeout = 10;
+    for (ngx_uint_t i = 1; i < cf->args->nelts; i++) {
+        if (elts[i].len > sizeof("zone=") - 1 && !ngx_strncmp(elts[i].data, "zone=", sizeof("zone=") - 1)) {
+            name.data = elts[i].data + sizeof("zone=") - 1;
+            name.len = elts[i].len - (sizeof("zone=") - 1);
+            u_char *p = ngx_strlchr(name.data, name.data + name.len, ':');
+            if (!p) continue;
+            ngx_str_t s = {name.data + name.len - p - 1, p + 1};
+            name.len = p - name.data;
+            if ((size = ngx_parse_size(&s)) == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &elts[i]); return NGX_CONF_ERROR; }
+            if (size < (ssize_t)(8 * ngx_pagesize)) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small", &elts[i]); return NGX_CONF_ERROR; }
+            continue;
+        }
+        if (elts[i].len > sizeof("max_fails=") - 1 && !ngx_strncmp(elts[i].data, "max_fails=", sizeof("max_fails=") - 1)) {
+            ngx_int_t n = ngx_atoi(elts[i].data + sizeof("max_fails=") - 1, elts[i].len - (sizeof("max_fails=") - 1));
+            if (n == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &elts[i]); return NGX_CONF_ERROR; }
+            location_conf->max_fails = (ngx_uint_t)n;
+            continue;
+        }
+        if (elts[i].len > sizeof("fail_timeout=") - 1 && !ngx_strncmp(elts[i].data, "fail_timeout=", sizeof("fail_timeout=") - 1)) {
+            ngx_str_t s = {elts[i].len - (sizeof("fail_timeout=") - 1), elts[i].data + sizeof("fail_timeout=") - 1};
+            if ((location_conf->fail_timeout = ngx_parse_time(&s, 1)) == (time_t)NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &elts[i]); return NGX_CONF_ERROR; }
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &elts[i]);
+        return NGX_CONF_ERROR;
+    }
+    if (!name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" must have \"zone\" parameter", &cmd->name); return NGX_CONF_ERROR; }
+    if (!(location_conf->servers = ngx_shared_memory_add(cf, &name, size, cmd))) return "!ngx_shared_memory_add";
+    if (location_conf->servers->data) return NGX_CONF_OK;
+    ngx_http_auth_basic_ldap_servers_t *servers = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_basic_ldap_servers_t));
+    if (!servers) return "!ngx_pcalloc";
+    location_conf->servers->init = ngx_http_auth_basic_ldap_servers_init_zone;
+    location_conf->servers->data = servers;
+    return NGX_CONF_OK;
+}
+
+static void ngx_http_auth_basic_ldap_fail_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+    ngx_rbtree_node_t **p;
+    for (;;) {
+        if (node->key < temp->key) p = &temp->left;
+        else if (node->key > temp->key) p = &temp->right;
+        else p = ngx_memcmp(((ngx_http_auth_basic_ldap_fail_node_t *)&node->color)->key, ((ngx_http_auth_basic_ldap_fail_node_t *)&temp->color)->key, NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN) < 0 ? &temp->left : &temp->right;
+        if (*p == sentinel) break;
+        temp = *p;
+    }
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_fail_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_auth_basic_ldap_fail_t *ofail = data;
+    ngx_http_auth_basic_ldap_fail_t *fail = shm_zone->data;
+    if (ofail) { fail->sh = ofail->sh; fail->shpool = ofail->shpool; return NGX_OK; }
+    fail->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    if (shm_zone->shm.exists) { fail->sh = fail->shpool->data; return NGX_OK; }
+    if (!(fail->sh = ngx_slab_alloc(fail->shpool, sizeof(ngx_http_auth_basic_ldap_fail_shctx_t)))) return NGX_ERROR;
+    fail->shpool->data = fail->sh;
+    ngx_rbtree_init(&fail->sh->rbtree, &fail->sh->sentinel, ngx_http_auth_basic_ldap_fail_rbtree_insert_value);
+    ngx_queue_init(&fail->sh->queue);
+    ngx_http_auth_basic_ldap_secret(fail->sh->secret);
+    size_t len = sizeof(" in auth_basic_ldap_fail_limit zone \"\"") + shm_zone->shm.name.len;
+    if (!(fail->shpool->log_ctx = ngx_slab_alloc(fail->shpool, len))) return NGX_ERROR;
+    ngx_sprintf(fail->shpool->log_ctx, " in auth_basic_ldap_fail_limit zone \"%V\"%Z", &shm_zone->shm.name);
+    fail->shpool->log_nomem = 0;
+    return NGX_OK;
+}
+
+static char *ngx_http_auth_basic_ldap_fail_limit_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = conf;
+    if (location_conf->fail_limit != NGX_CONF_UNSET_PTR) return "is duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    if (cf->args->nelts == 2 && elts[1].len == sizeof("off") - 1 && !ngx_strncmp(elts[1].data, "off", sizeof("off") - 1)) { location_conf->fail_limit = NULL; return NGX_CONF_OK; }
+    ngx_str_t name = ngx_null_string;
+    ssize_t size = 0;
+    location_conf->fail_rate = 1000 / 60;
+    location_conf->fail_burst = 5;
+    location_conf->fail_status = NGX_HTTP_UNAUTHORIZED;
+    for (ngx_uint_t i = 1; i < cf->args->nelts; i++) {
+        if (elts[i].len > sizeof("zone=") - 1 && !ngx_strncmp(elts[i].data, "zone=", sizeof("zone=") - 1)) {
+            name.data = elts[i].data + sizeof("zone=") - 1;
+            name.len = elts[i].len - (sizeof("zone=") - 1);
+            u_char *p = ngx_strlchr(name.data, name.data + name.len, ':');
+            if (!p) continue;
+            ngx_str_t s = {name.data + name.len - p - 1, p + 1};
+            name.len = p - name.data;
+            if ((size = ngx_parse_size(&s)) == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &elts[i]); return NGX_CONF_ERROR; }
+            if (size < (ssize_t)(8 * ngx_pagesize)) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small", &elts[i]); return NGX_CONF_ERROR; }
+            continue;
+        }
+        if (elts[i].len > sizeof("rate=") - 1 && !ngx_strncmp(elts[i].data, "rate=", sizeof("rate=") - 1)) {
+            size_t len = elts[i].len;
+            ngx_uint_t scale = 1;
+            if (len > sizeof("rate=r/s") - 1 && !ngx_strncmp(elts[i].data + len - 3, "r/s", 3)) len -= 3;
+            else if (len > sizeof("rate=r/m") - 1 && !ngx_strncmp(elts[i].data + len - 3, "r/m", 3)) { len -= 3; scale = 60; }
+            ngx_int_t n = ngx_atoi(elts[i].data + sizeof("rate=") - 1, len - (sizeof("rate=") - 1));
+            if (n <= 0) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid rate \"%V\"", &elts[i]); return NGX_CONF_ERROR; }
+            location_conf->fail_rate = (ngx_uint_t)n * 1000 / scale;
+            continue;
+        }
+        if (elts[i].len > sizeof("burst=") - 1 && !ngx_strncmp(elts[i].data, "burst=", sizeof("burst=") - 1)) {
+            ngx_int_t n = ngx_atoi(elts[i].data + sizeof("burst=") - 1, elts[i].len - (sizeof("burst=") - 1));
+            if (n == NGX_ERROR) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid burst value \"%V\"", &elts[i]); return NGX_CONF_ERROR; }
+            location_conf->fail_burst = (ngx_uint_t)n;
+            continue;
+        }
+        if (elts[i].len > sizeof("status=") - 1 && !ngx_strncmp(elts[i].data, "status=", sizeof("status=") - 1)) {
+            ngx_int_t n = ngx_atoi(elts[i].data + sizeof("status=") - 1, elts[i].len - (sizeof("status=") - 1));
+            if (n < 400 || n > 599) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid status \"%V\"", &elts[i]); return NGX_CONF_ERROR; }
+            location_conf->fail_status = (ngx_uint_t)n;
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &elts[i]);
+        return NGX_CONF_ERROR;
+    }
+    if (!name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" must have \"zone\" parameter", &cmd->name); return NGX_CONF_ERROR; }
+    if (!location_conf->fail_rate) location_conf->fail_rate = 1;
+    if (!(location_conf->fail_limit = ngx_shared_memory_add(cf, &name, size, cmd))) return "!ngx_shared_memory_add";
+    if (location_conf->fail_limit->data) return NGX_CONF_OK;
+    ngx_http_auth_basic_ldap_fail_t *fail = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_basic_ldap_fail_t));
+    if (!fail) return "!ngx_pcalloc";
+    location_conf->fail_limit->init = ngx_http_auth_basic_ldap_fail_init_zone;
+    location_conf->fail_limit->data = fail;
+    return NGX_CONF_OK;
+}
+
+static u_char *ngx_http_auth_basic_ldap_status_json(u_char *p, ngx_http_auth_basic_ldap_servers_t *servers) {
+    p = ngx_cpymem(p, "{\"servers\":{", sizeof("{\"servers\":{") - 1);
+    ngx_rbtree_node_t *root = servers->sh->rbtree.root;
+    ngx_rbtree_node_t *sentinel = servers->sh->rbtree.sentinel;
+    for (ngx_rbtree_node_t *node = root == sentinel ? NULL : ngx_rbtree_min(root, sentinel); node; node = ngx_rbtree_next(&servers->sh->rbtree, node)) {
+        ngx_http_auth_basic_ldap_servers_node_t *servers_node = (ngx_http_auth_basic_ldap_servers_node_t *)&node->color;
+        u_char name[NGX_SOCKADDR_STRLEN];
+        size_t len = ngx_sock_ntop((struct sockaddr *)servers_node->sockaddr, servers_node->socklen, name, NGX_SOCKADDR_STRLEN, 1);
+        p = ngx_sprintf(p, "%s\"%*s\":{\"outstanding\":%ui,\"fails\":%ui,\"ewma\":%M", p[-1] == '{' ? "" : ",", len, name, servers_node->outstanding, servers_node->fails, servers_node->ewma / NGX_HTTP_AUTH_BASIC_LDAP_EWMA_SCALE);
+        for (ngx_uint_t i = 0; i < NGX_HTTP_AUTH_BASIC_LDAP_COUNTERS; i++) p = ngx_sprintf(p, ",\"%V\":%ui", &ngx_http_auth_basic_ldap_counters[i], servers_node->counters[i]);
+        p = ngx_cpymem(p, ",\"latency\":{", sizeof(",\"latency\":{") - 1);
+        for (ngx_uint_t i = 0; i < NGX_HTTP_AUTH_BASIC_LDAP_PHASES; i++) {
+            ngx_uint_t count = 0;
+            for (ngx_uint_t j = 0; j < NGX_HTTP_AUTH_BASIC_LDAP_BUCKETS; j++) count += servers_node->buckets[i][j];
+            p = ngx_sprintf(p, "%s\"%V\":{\"count\":%ui,\"sum\":%M,\"buckets\":{", i ? "," : "", &ngx_http_auth_basic_ldap_phases[i], count, servers_node->sum[i]);
+            count = 0;
+            for (ngx_uint_t j = 0; j < NGX_HTTP_AUTH_BASIC_LDAP_BUCKETS - 1; j++) p = ngx_sprintf(p, "%s\"%M\":%ui", j ? "," : "", ngx_http_auth_basic_ldap_buckets[j], count += servers_node->buckets[i][j]);
+            p = ngx_sprintf(p, ",\"+Inf\":%ui}}", count + servers_node->buckets[i][NGX_HTTP_AUTH_BASIC_LDAP_BUCKETS - 1]);
+        }
+        p = ngx_cpymem(p, "}}", sizeof("}}") - 1);
+    }
+    return ngx_cpymem(p, "}}\n", sizeof("}}\n") - 1);
+}
+
+static u_char *ngx_http_auth_basic_ldap_status_prometheus(u_char *p, ngx_http_auth_basic_ldap_servers_t *servers) {
+    static ngx_str_t gauges[] = { ngx_string("outstanding"), ngx_string("fails"), ngx_string("ewma_seconds") };
+    ngx_rbtree_node_t *root = servers->sh->rbtree.root;
+    ngx_rbtree_node_t *sentinel = servers->sh->rbtree.sentinel;
+    u_char name[NGX_SOCKADDR_STRLEN];
+    size_t len;
+    for (ngx_uint_t i = 0; i < 3 + NGX_HTTP_AUTH_BASIC_LDAP_COUNTERS; i++) {
+        if (i < 3) p = ngx_sprintf(p, "# TYPE auth_basic_ldap_%V gauge\n", &gauges[i]);
+        else p = ngx_sprintf(p, "# TYPE auth_basic_ldap_%V_total counter\n", &ngx_http_auth_basic_ldap_counters[i - 3]);
+        for (ngx_rbtree_node_t *node = root == sentinel ? NULL : ngx_rbtree_min(root, sentinel); node; node = ngx_rbtree_next(&servers->sh->rbtree, node)) {
+            ngx_http_auth_basic_ldap_servers_node_t *servers_node = (ngx_http_auth_basic_ldap_servers_node_t *)&node->color;
+            len = ngx_sock_ntop((struct sockaddr *)servers_node->sockaddr, servers_node->socklen, name, NGX_SOCKADDR_STRLEN, 1);
+            switch (i) {
+                case 0: p = ngx_sprintf(p, "auth_basic_ldap_%V{server=\"%*s\"} %ui\n", &gauges[i], len, name, servers_node->outstanding); break;
+                case 1: p = ngx_sprintf(p, "auth_basic_ldap_%V{server=\"%*s\"} %ui\n", &gauges[i], len, name, servers_node->fails); break;
+                case 2: { ngx_msec_t ewma = servers_node->ewma / NGX_HTTP_AUTH_BASIC_LDAP_EWMA_SCALE; p = ngx_sprintf(p, "auth_basic_ldap_%V{server=\"%*s\"} %M.%03M\n", &gauges[i], len, name, ewma / 1000, ewma % 1000); } break;
+                default: p = ngx_sprintf(p, "auth_basic_ldap_%V_total{server=\"%*s\"} %ui\n", &ngx_http_auth_basic_ldap_counters[i - 3], len, name, servers_node->counters[i - 3]); break;
+            }
+        }
+    }
+    p = ngx_cpymem(p, "# TYPE auth_basic_ldap_latency_seconds histogram\n", sizeof("# TYPE auth_basic_ldap_latency_seconds histogram\n") - 1);
+    for (ngx_rbtree_node_t *node = root == sentinel ? NULL : ngx_rbtree_min(root, sentinel); node; node = ngx_rbtree_next(&servers->sh->rbtree, node)) {
+        ngx_http_auth_basic_ldap_servers_node_t *servers_node = (ngx_http_auth_basic_ldap_servers_node_t *)&node->color;
+        len = ngx_sock_ntop((struct sockaddr *)servers_node->sockaddr, servers_node->socklen, name, NGX_SOCKADDR_STRLEN, 1);
+        for (ngx_uint_t i = 0; i < NGX_HTTP_AUTH_BASIC_LDAP_PHASES; i++) {
+            ngx_uint_t count = 0;
+            for (ngx_uint_t j = 0; j < NGX_HTTP_AUTH_BASIC_LDAP_BUCKETS - 1; j++) p = ngx_sprintf(p, "auth_basic_ldap_latency_seconds_bucket{server=\"%*s\",phase=\"%V\",le=\"%M.%03M\"} %ui\n", len, name, &ngx_http_auth_basic_ldap_phases[i], ngx_http_auth_basic_ldap_buckets[j] / 1000, ngx_http_auth_basic_ldap_buckets[j] % 1000, count += servers_node->buckets[i][j]);
+            count += servers_node->buckets[i][NGX_HTTP_AUTH_BASIC_LDAP_BUCKETS - 1];
+            p = ngx_sprintf(p, "auth_basic_ldap_latency_seconds_bucket{server=\"%*s\",phase=\"%V\",le=\"+Inf\"} %ui\n", len, name, &ngx_http_auth_basic_ldap_phases[i], count);
+            p = ngx_sprintf(p, "auth_basic_ldap_latency_seconds_sum{server=\"%*s\",phase=\"%V\"} %M.%03M\n", len, name, &ngx_http_auth_basic_ldap_phases[i], servers_node->sum[i] / 1000, servers_node->sum[i] % 1000);
+            p = ngx_sprintf(p, "auth_basic_ldap_latency_seconds_count{server=\"%*s\",phase=\"%V\"} %ui\n", len, name, &ngx_http_auth_basic_ldap_phases[i], count);
+        }
+    }
+    return p;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_status_handler(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) return NGX_HTTP_NOT_ALLOWED;
+    ngx_int_t rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) return rc;
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_servers_t *servers = location_conf->servers->data;
+    ngx_shmtx_lock(&servers->shpool->mutex);
+    ngx_uint_t n = 1;
+    ngx_rbtree_node_t *root = servers->sh->rbtree.root;
+    ngx_rbtree_node_t *sentinel = servers->sh->rbtree.sentinel;
+    for (ngx_rbtree_node_t *node = root == sentinel ? NULL : ngx_rbtree_min(root, sentinel); node; node = ngx_rbtree_next(&servers->sh->rbtree, node)) n++;
+    ngx_buf_t *b = ngx_create_temp_buf(r->pool, n * NGX_HTTP_AUTH_BASIC_LDAP_STATUS_LEN);
+    if (!b) { ngx_shmtx_unlock(&servers->shpool->mutex); ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_create_temp_buf"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    b->last = location_conf->status == NGX_HTTP_AUTH_BASIC_LDAP_STATUS_JSON ? ngx_http_auth_basic_ldap_status_json(b->last, servers) : ngx_http_auth_basic_ldap_status_prometheus(b->last, servers);
+    ngx_shmtx_unlock(&servers->shpool->mutex);
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    if (location_conf->status == NGX_HTTP_AUTH_BASIC_LDAP_STATUS_JSON) { ngx_str_set(&r->headers_out.content_type, "application/json"); } else { ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4"); }
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    b->last_buf = r == r->main ? 1 : 0;
+    b->last_in_chain = 1;
+    if ((rc = ngx_http_send_header(r)) == NGX_ERROR || rc > NGX_OK || r->header_only) return rc;
+    ngx_chain_t out = {b, NULL};
+    return ngx_http_output_filter(r, &out);
+}
+
+static char *ngx_http_auth_basic_ldap_status_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = conf;
+    if (location_conf->status) return "is duplicate";
+    location_conf->status = NGX_HTTP_AUTH_BASIC_LDAP_STATUS_JSON;
+    if (cf->args->nelts > 1) {
+        ngx_str_t *elts = cf->args->elts;
+        ngx_conf_enum_t *e = cmd->post;
+        while (e->name.len && (e->name.len != elts[1].len || ngx_strcasecmp(e->name.data, elts[1].data))) e++;
+        if (!e->name.len) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid value \"%V\"", &elts[1]); return NGX_CONF_ERROR; }
+        location_conf->status = e->value;
+    }
+    ngx_http_core_loc_conf_t *core_loc_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    core_loc_conf->handler = ngx_http_auth_basic_ldap_status_handler;
+    return NGX_CONF_OK;
+}
+
+static char *ngx_http_auth_basic_ldap_service_bind_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = conf;
+    if (location_conf->service_bind.data) return "is duplicate";
+    ngx_str_t *elts = cf->args->elts;
+    if (!elts[1].len) return "empty dn";
+    location_conf->service_bind = elts[1];
+    location_conf->service_password = elts[2];
+    return NGX_CONF_OK;
+}
+
+static char *ngx_http_auth_basic_ldap_require_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = conf;
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_auth_basic_ldap_module);
+    ngx_str_t *elts = cf->args->elts;
+    if (elts[1].len != sizeof("group") - 1 || ngx_strncmp(elts[1].data, "group", sizeof("group") - 1)) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &elts[1]); return NGX_CONF_ERROR; }
+    if (location_conf->require == NGX_CONF_UNSET_PTR && !(location_conf->require = ngx_array_create(cf->pool, 1, sizeof(ngx_http_auth_basic_ldap_require_t)))) return "!ngx_array_create";
+    ngx_http_auth_basic_ldap_require_t *require = ngx_array_push(location_conf->require);
+    if (!require) return "!ngx_array_push";
+    require->ngroups = 0;
+    if (!(require->groups = ngx_palloc(cf->pool, sizeof(uint32_t) * (cf->args->nelts - 2)))) return "!ngx_palloc";
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        if (!elts[i].len) return "empty dn";
+        if (elts[i].len > NGX_HTTP_AUTH_BASIC_LDAP_DN_LEN) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "too long group \"%V\"", &elts[i]); return NGX_CONF_ERROR; }
+        ngx_str_t *groups = main_conf->groups.elts;
+        ngx_uint_t j, k;
+        for (j = 0; j < main_conf->groups.nelts; j++) if (groups[j].len == elts[i].len && !ngx_strncasecmp(groups[j].data, elts[i].data, elts[i].len)) break;
+        if (j == main_conf->groups.nelts) {
+            ngx_str_t *group = ngx_array_push(&main_conf->groups);
+            if (!group) return "!ngx_array_push";
+            if (!(group->data = ngx_pnalloc(cf->pool, elts[i].len))) return "!ngx_pnalloc";
+            group->len = elts[i].len;
+            ngx_strlow(group->data, elts[i].data, elts[i].len);
+        }
+        for (k = 0; k < require->ngroups; k++) if (require->groups[k] == j) break;
+        if (k == require->ngroups) require->groups[require->ngroups++] = (uint32_t)j;
+    }
+    return NGX_CONF_OK;
+}
+
 static ngx_command_t ngx_http_auth_basic_ldap_commands[] = {
   { .name = ngx_string("auth_basic_ldap_attr"),
     .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1
@@ -68,24 +939,188 @@ static ngx_command_t ngx_http_auth_basic_ldap_commands[] = {
     .conf = NGX_HTTP_LOC_CONF_OFFSET,
     .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, attrs),
     .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_attr_separator"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    .set = ngx_conf_set_str_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, attr_separator),
+    .post = NULL },
   { .name = ngx_string("auth_basic_ldap_bind"),
     .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
     .set = ngx_http_set_complex_value_slot,
     .conf = NGX_HTTP_LOC_CONF_OFFSET,
     .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, bind),
     .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_bind_timeout"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    .set = ngx_conf_set_msec_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, bind_timeout),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_cache"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+    .set = ngx_http_auth_basic_ldap_cache_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, cache),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_cache_background_update"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    .set = ngx_conf_set_flag_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, cache_background_update),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_cache_sync"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+    .set = ngx_http_auth_basic_ldap_cache_sync_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, cache_sync),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_cache_use_stale"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+    .set = ngx_conf_set_bitmask_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, cache_use_stale),
+    .post = &ngx_http_auth_basic_ldap_cache_use_stale_masks },
+  { .name = ngx_string("auth_basic_ldap_coalesce"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    .set = ngx_conf_set_flag_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, coalesce),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_connect_timeout"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    .set = ngx_conf_set_msec_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, connect_timeout),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_fail_limit"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+    .set = ngx_http_auth_basic_ldap_fail_limit_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, fail_limit),
+    .post = NULL },
   { .name = ngx_string("auth_basic_ldap_header"),
     .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
     .set = ngx_http_set_complex_value_slot,
     .conf = NGX_HTTP_LOC_CONF_OFFSET,
     .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, header),
     .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_headers"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    .set = ngx_conf_set_flag_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, headers),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_keepalive"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    .set = ngx_conf_set_num_slot,
+    .conf = NGX_HTTP_MAIN_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_main_conf_t, keepalive),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_keepalive_timeout"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    .set = ngx_conf_set_msec_slot,
+    .conf = NGX_HTTP_MAIN_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_main_conf_t, keepalive_timeout),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_nested_groups"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    .set = ngx_conf_set_flag_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, nested_groups),
+    .post = NULL },
   { .name = ngx_string("auth_basic_ldap_realm"),
     .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
     .set = ngx_http_set_complex_value_slot,
     .conf = NGX_HTTP_LOC_CONF_OFFSET,
     .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, realm),
     .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_require"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
+    .set = ngx_http_auth_basic_ldap_require_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, require),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_search_timeout"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    .set = ngx_conf_set_msec_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, search_timeout),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_servers"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+    .set = ngx_http_auth_basic_ldap_servers_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, servers),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_service_bind"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+    .set = ngx_http_auth_basic_ldap_service_bind_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, service_bind),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_service_connections"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    .set = ngx_conf_set_num_slot,
+    .conf = NGX_HTTP_MAIN_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_main_conf_t, service_connections),
+    .post = NULL },
+#if (NGX_SSL)
+  { .name = ngx_string("auth_basic_ldap_ssl_name"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    .set = ngx_conf_set_str_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, ssl_name),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_ssl_server_name"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    .set = ngx_conf_set_flag_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, ssl_server_name),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_ssl_session_reuse"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    .set = ngx_conf_set_flag_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, ssl_session_reuse),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_ssl_trusted_certificate"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    .set = ngx_conf_set_str_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, ssl_trusted_certificate),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_ssl_verify"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    .set = ngx_conf_set_flag_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, ssl_verify),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_ssl_verify_depth"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    .set = ngx_conf_set_num_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, ssl_verify_depth),
+    .post = NULL },
+  { .name = ngx_string("auth_basic_ldap_starttls"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    .set = ngx_conf_set_flag_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, starttls),
+    .post = NULL },
+#endif
+  { .name = ngx_string("auth_basic_ldap_status"),
+    .type = NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+    .set = ngx_http_auth_basic_ldap_status_conf,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, status),
+    .post = &ngx_http_auth_basic_ldap_status_formats },
+  { .name = ngx_string("auth_basic_ldap_tries"),
+    .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    .set = ngx_conf_set_num_slot,
+    .conf = NGX_HTTP_LOC_CONF_OFFSET,
+    .offset = offsetof(ngx_http_auth_basic_ldap_location_conf_t, tries),
+    .post = NULL },
   { .name = ngx_string("auth_basic_ldap_url"),
     .type = NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
     .set = ngx_http_set_complex_value_slot,
@@ -97,8 +1132,9 @@ static ngx_command_t ngx_http_auth_basic_ldap_commands[] = {
 
 static ngx_int_t ngx_http_auth_basic_ldap_set_realm(ngx_http_request_t *r) {
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
-    if (!(r->headers_out.www_authenticate = ngx_list_push(&r->headers_out.headers))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_list_push"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
     ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    if (context->background) return NGX_HTTP_UNAUTHORIZED;
+    if (!(r->headers_out.www_authenticate = ngx_list_push(&r->headers_out.headers))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_list_push"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
     size_t len = sizeof("Basic realm=\"\"") - 1 + context->realm.len;
     u_char *basic = ngx_pnalloc(r->pool, len);
     if (!basic) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); r->headers_out.www_authenticate->hash = 0; r->headers_out.www_authenticate = NULL; return NGX_HTTP_INTERNAL_SERVER_ERROR; }
@@ -112,183 +1148,2030 @@ static ngx_int_t ngx_http_auth_basic_ldap_set_realm(ngx_http_request_t *r) {
     return NGX_HTTP_UNAUTHORIZED;
 }
 
-static void ngx_http_auth_basic_ldap_bind(ngx_http_request_t *r) {
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
-    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
-    if (!context->lud->lud_dn) { context->rc = NGX_OK; return; }
-    int rc = ldap_search_ext(context->ldap, context->lud->lud_dn, context->lud->lud_scope, context->lud->lud_filter, context->lud->lud_attrs, 0, NULL, NULL, NULL, 0, &context->msgid);
-    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_search_ext failed: %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_set_realm; }
-    return;
-ngx_http_auth_basic_ldap_set_realm:
-    context->rc = ngx_http_auth_basic_ldap_set_realm(r);
-    return;
+static ngx_http_auth_basic_ldap_cache_node_t *ngx_http_auth_basic_ldap_cache_lookup(ngx_http_auth_basic_ldap_cache_t *cache, u_char *key) {
+    ngx_rbtree_key_t hash = ngx_crc32_short(key, NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN);
+    ngx_rbtree_node_t *node = cache->sh->rbtree.root;
+    ngx_rbtree_node_t *sentinel = cache->sh->rbtree.sentinel;
+    while (node != sentinel) {
+        if (hash < node->key) { node = node->left; continue; }
+        if (hash > node->key) { node = node->right; continue; }
+        ngx_http_auth_basic_ldap_cache_node_t *cache_node = (ngx_http_auth_basic_ldap_cache_node_t *)&node->color;
+        ngx_int_t rc = ngx_memcmp(key, cache_node->key, NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN);
+        if (!rc) return cache_node;
+        node = rc < 0 ? node->left : node->right;
+    }
+    return NULL;
 }
 
-static void ngx_http_auth_basic_ldap_search_entry(ngx_http_request_t *r) {
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
-    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
-    BerElement *ber = NULL;
-    char *attr = NULL;
-    struct berval **vals = NULL;
-    int rc = ldap_count_entries(context->ldap, context->result);
-    if (rc <= 0) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_count_entries failed: %i", rc); goto ngx_http_auth_basic_ldap_set_realm; }
-    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
-    ngx_str_t header = ngx_null_string;
-    if (location_conf->header && ngx_http_complex_value(r, location_conf->header, &header) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_http_complex_value"); goto rc_NGX_ERROR; }
-    for (LDAPMessage *entry = ldap_first_entry(context->ldap, context->result); entry; entry = ldap_next_entry(context->ldap, entry)) {
-        for (attr = ldap_first_attribute(context->ldap, entry, &ber); attr; ldap_memfree(attr), attr = ldap_next_attribute(context->ldap, entry, ber)) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: attr = %s", attr);
-            if (!(vals = ldap_get_values_len(context->ldap, entry, attr))) { ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "!ldap_get_values_len"); goto ngx_http_auth_basic_ldap_set_realm; }
-            int cnt = ldap_count_values_len(vals);
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: ldap_count_values = %i", cnt);
-            ngx_str_t key;
-            key.len = ngx_strlen(attr) + header.len;
-#if (NGX_PCRE)
-            ngx_http_auth_basic_ldap_attr_t *elt = NULL;
-            if (location_conf->attrs != NGX_CONF_UNSET_PTR && location_conf->attrs->nelts) {
-                ngx_http_auth_basic_ldap_attr_t *elts = location_conf->attrs->elts;
-                for (ngx_uint_t i = 0; i < location_conf->attrs->nelts; i++) if (elts[i].http_regex && elts[i].attr.len == key.len - header.len && !ngx_strncasecmp(elts[i].attr.data, (u_char *)attr, key.len - header.len)) { elt = &elts[i]; break; }
-            }
-#endif
-            if (!(key.data = ngx_pnalloc(r->pool, key.len))) { ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "!ngx_pnalloc"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
-            if (header.len) ngx_memcpy(key.data, header.data, header.len);
-            ngx_memcpy(key.data + header.len, attr, key.len - header.len);
-            for (int i = 0; i < cnt; i++) {
-                struct berval *val = vals[i];
-                ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: vals[%i] = %*.s", i, (int)val->bv_len, val->bv_val);
-                ngx_str_t value;
-                value.len = val->bv_len;
-                if (!(value.data = ngx_pnalloc(r->pool, value.len))) { ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "!ngx_pnalloc"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
-                ngx_memcpy(value.data, val->bv_val, value.len);
-#if (NGX_PCRE)
-                if (elt) {
-                    switch (ngx_http_regex_exec(r, elt->http_regex, &value)) {
-                        case NGX_ERROR: ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_regex_exec == NGX_ERROR"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR;
-                        case NGX_DECLINED: ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "skip: vals[%i] = %*.s", i, (int)val->bv_len, val->bv_val); continue;
-                    }
-                    if (ngx_http_complex_value(r, &elt->complex_value, &value) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
-                }
-#endif
-                ngx_table_elt_t *table_elt = ngx_list_push(&r->headers_in.headers);
-                if (!table_elt) { ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "!ngx_list_push"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
-                table_elt->key = key;
-                table_elt->value = value;
-            }
-            ldap_value_free_len(vals);
+static ngx_http_auth_basic_ldap_cache_link_t *ngx_http_auth_basic_ldap_cache_links(ngx_http_auth_basic_ldap_cache_node_t *cache_node) {
+    return (ngx_http_auth_basic_ldap_cache_link_t *)ngx_align_ptr(cache_node->data + cache_node->size + sizeof(uint32_t) * cache_node->ngroups, NGX_ALIGNMENT);
+}
+
+static void ngx_http_auth_basic_ldap_cache_delete(ngx_http_auth_basic_ldap_cache_t *cache, ngx_http_auth_basic_ldap_cache_node_t *cache_node) {
+    ngx_rbtree_node_t *node = (ngx_rbtree_node_t *)((u_char *)cache_node - offsetof(ngx_rbtree_node_t, color));
+    ngx_queue_remove(&cache_node->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, node);
+    ngx_rbtree_delete(&cache->sh->dn_rbtree, &cache_node->dn_link.node);
+    ngx_http_auth_basic_ldap_cache_link_t *links = ngx_http_auth_basic_ldap_cache_links(cache_node);
+    for (ngx_uint_t i = 0; i < cache_node->ngroups; i++) ngx_rbtree_delete(&cache->sh->group_rbtree, &links[i].node);
+    ngx_slab_free_locked(cache->shpool, node);
+}
+
+static void ngx_http_auth_basic_ldap_cache_expire(ngx_http_auth_basic_ldap_cache_t *cache, ngx_uint_t force) {
+    time_t now = ngx_time();
+    for (ngx_uint_t n = 0; n < 3; n++) {
+        if (ngx_queue_empty(&cache->sh->queue)) return;
+        ngx_http_auth_basic_ldap_cache_node_t *cache_node = ngx_queue_data(ngx_queue_last(&cache->sh->queue), ngx_http_auth_basic_ldap_cache_node_t, queue);
+        if (!force && cache_node->stale > now) return;
+        force = 0;
+        ngx_http_auth_basic_ldap_cache_delete(cache, cache_node);
+    }
+}
+
+static ngx_uint_t ngx_http_auth_basic_ldap_cache_evict_key(ngx_http_auth_basic_ldap_cache_t *cache, ngx_rbtree_t *rbtree, ngx_rbtree_key_t key) {
+    ngx_uint_t n = 0;
+    for (;;) {
+        ngx_rbtree_node_t *node = rbtree->root;
+        while (node != rbtree->sentinel && node->key != key) node = key < node->key ? node->left : node->right;
+        if (node == rbtree->sentinel) return n;
+        ngx_http_auth_basic_ldap_cache_delete(cache, ((ngx_http_auth_basic_ldap_cache_link_t *)node)->cache_node);
+        n++;
+    }
+}
+
+static ngx_uint_t ngx_http_auth_basic_ldap_cache_evict(ngx_http_auth_basic_ldap_cache_t *cache, ngx_array_t *hashes, ngx_array_t *groups) {
+    ngx_uint_t n = 0;
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    if (hashes) {
+        uint32_t *elts = hashes->elts;
+        for (ngx_uint_t i = 0; i < hashes->nelts; i++) n += ngx_http_auth_basic_ldap_cache_evict_key(cache, &cache->sh->dn_rbtree, elts[i]);
+        elts = groups->elts;
+        for (ngx_uint_t i = 0; i < groups->nelts; i++) n += ngx_http_auth_basic_ldap_cache_evict_key(cache, &cache->sh->group_rbtree, elts[i]);
+    } else while (!ngx_queue_empty(&cache->sh->queue)) { ngx_http_auth_basic_ldap_cache_delete(cache, ngx_queue_data(ngx_queue_head(&cache->sh->queue), ngx_http_auth_basic_ldap_cache_node_t, queue)); n++; }
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return n;
+}
+
+static uint32_t ngx_http_auth_basic_ldap_dn_hash(u_char *data, size_t len) {
+    uint32_t hash;
+    u_char buf[64];
+    ngx_crc32_init(hash);
+    for (size_t i = 0; i < len; i += sizeof(buf)) {
+        size_t n = ngx_min(sizeof(buf), len - i);
+        ngx_strlow(buf, data + i, n);
+        ngx_crc32_update(&hash, buf, n);
+    }
+    ngx_crc32_final(hash);
+    return hash ? hash : 1;
+}
+
+static int ngx_http_auth_basic_ldap_hash_cmp(const void *one, const void *two) {
+    uint32_t a = *(uint32_t *)one;
+    uint32_t b = *(uint32_t *)two;
+    return a < b ? -1 : a > b;
+}
+
+static uintptr_t ngx_http_auth_basic_ldap_group_id(ngx_http_auth_basic_ldap_main_conf_t *main_conf, u_char *dn, size_t len) {
+    if (!main_conf->group_hash.buckets || len > NGX_HTTP_AUTH_BASIC_LDAP_DN_LEN) return 0;
+    u_char name[NGX_HTTP_AUTH_BASIC_LDAP_DN_LEN];
+    return (uintptr_t)ngx_hash_find(&main_conf->group_hash, ngx_hash_strlow(name, dn, len), name, len);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_group(ngx_http_request_t *r, ngx_array_t *groups, u_char *dn, size_t len) {
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf = ngx_http_get_module_main_conf(r, ngx_http_auth_basic_ldap_module);
+    uintptr_t id = ngx_http_auth_basic_ldap_group_id(main_conf, dn, len);
+    if (!id) return NGX_DECLINED;
+    uint32_t *group = ngx_array_push(groups);
+    if (!group) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_array_push"); return NGX_ERROR; }
+    *group = (uint32_t)(id - 1);
+    return NGX_OK;
+}
+
+static void ngx_http_auth_basic_ldap_groups_sort(ngx_array_t *groups) {
+    uint32_t *elts = groups->elts;
+    if (groups->nelts < 2) return;
+    ngx_qsort(elts, groups->nelts, sizeof(uint32_t), ngx_http_auth_basic_ldap_hash_cmp);
+    ngx_uint_t n = 1;
+    for (ngx_uint_t i = 1; i < groups->nelts; i++) if (elts[i] != elts[n - 1]) elts[n++] = elts[i];
+    groups->nelts = n;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_groups(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_array_t *groups = ngx_array_create(r->pool, 4, sizeof(uint32_t));
+    if (!groups) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_array_create"); return NGX_ERROR; }
+    ngx_keyval_t *elts = context->attrs ? context->attrs->elts : NULL;
+    ngx_uint_t nelts = context->attrs ? context->attrs->nelts : 0;
+    for (ngx_uint_t i = 0; i < nelts; i++) {
+        if (elts[i].key.len != sizeof("memberOf") - 1 || ngx_strncasecmp(elts[i].key.data, (u_char *)"memberOf", sizeof("memberOf") - 1)) continue;
+        if (ngx_http_auth_basic_ldap_group(r, groups, elts[i].value.data, elts[i].value.len) == NGX_ERROR) return NGX_ERROR;
+    }
+    ngx_http_auth_basic_ldap_groups_sort(groups);
+    context->groups = groups;
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_require(ngx_http_request_t *r, ngx_int_t rc) {
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    if (rc != NGX_OK || !location_conf->require) return rc;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    if (!context->groups && ngx_http_auth_basic_ldap_groups(r) != NGX_OK) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    uint32_t *groups = context->groups->elts;
+    ngx_uint_t ngroups = context->groups->nelts;
+    ngx_http_auth_basic_ldap_require_t *require = location_conf->require->elts;
+    for (ngx_uint_t i = 0; i < location_conf->require->nelts; i++) {
+        ngx_uint_t j;
+        for (j = 0; j < require[i].ngroups; j++) {
+            ngx_uint_t lo = 0, hi = ngroups;
+            while (lo < hi) { ngx_uint_t mid = (lo + hi) / 2; if (groups[mid] < require[i].groups[j]) lo = mid + 1; else hi = mid; }
+            if (lo < ngroups && groups[lo] == require[i].groups[j]) break;
+        }
+        if (j == require[i].ngroups) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: user \"%V\" is not a member of required groups", &r->headers_in.user); return NGX_HTTP_FORBIDDEN; }
+    }
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_cache_key(ngx_http_request_t *r, u_char *secret, ngx_str_t *url, u_char *key) {
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_str_t bind = ngx_null_string;
+    if (location_conf->bind && ngx_http_complex_value(r, location_conf->bind, &bind) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); return NGX_ERROR; }
+    ngx_md5_t md5;
+    ngx_http_auth_basic_ldap_hmac_init(&md5, secret);
+    ngx_md5_update(&md5, r->headers_in.user.data, r->headers_in.user.len);
+    ngx_md5_update(&md5, "", 1);
+    ngx_md5_update(&md5, r->headers_in.passwd.data, r->headers_in.passwd.len);
+    ngx_md5_update(&md5, "", 1);
+    ngx_md5_update(&md5, url->data, url->len);
+    ngx_md5_update(&md5, "", 1);
+    ngx_md5_update(&md5, bind.data, bind.len);
+    if (location_conf->nested_groups) ngx_md5_update(&md5, "\0nested", sizeof("\0nested") - 1);
+    ngx_http_auth_basic_ldap_hmac_final(&md5, secret, key);
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_cache_get(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf = ngx_http_get_module_main_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_cache_t *cache = location_conf->cache->data;
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_http_auth_basic_ldap_cache_node_t *cache_node = ngx_http_auth_basic_ldap_cache_lookup(cache, context->key);
+    time_t now = ngx_time();
+    if (!cache_node || cache_node->stale <= now || ((location_conf->nested_groups || location_conf->require) && cache_node->generation != main_conf->generation)) { ngx_shmtx_unlock(&cache->shpool->mutex); return NGX_DECLINED; }
+    ngx_int_t rc = NGX_OK;
+    if (cache_node->expire <= now) {
+        if (cache_node->updating > now) rc = NGX_BUSY; else {
+            cache_node->updating = now + (time_t)((location_conf->connect_timeout + location_conf->bind_timeout + location_conf->search_timeout) / 1000) + 1;
+            rc = NGX_AGAIN;
+        }
+    }
+    ngx_queue_remove(&cache_node->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &cache_node->queue);
+    context->rc = cache_node->rc;
+    ngx_uint_t nelts = cache_node->nelts;
+    size_t size = cache_node->size;
+    u_char *data = NULL;
+    if (size && (data = ngx_pnalloc(r->pool, size))) ngx_memcpy(data, cache_node->data, size);
+    ngx_uint_t groups = main_conf->generation && cache_node->generation == main_conf->generation;
+    ngx_uint_t ngroups = cache_node->ngroups;
+    if (groups && (context->groups = ngx_array_create(r->pool, ngroups ? ngroups : 1, sizeof(uint32_t)))) { ngx_memcpy(context->groups->elts, cache_node->data + size, sizeof(uint32_t) * ngroups); context->groups->nelts = ngroups; }
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (size && !data) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+    if (groups && !context->groups) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_array_create"); return NGX_ERROR; }
+    if (!nelts) return rc;
+    if (!(context->attrs = ngx_array_create(r->pool, nelts, sizeof(ngx_keyval_t)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_array_create"); return NGX_ERROR; }
+    for (u_char *p = data, *last = data + size; p < last; ) {
+        uint32_t len, cnt;
+        ngx_str_t key;
+        ngx_memcpy(&len, p, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+        key.len = len;
+        key.data = p;
+        p += len;
+        ngx_memcpy(&cnt, p, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+        while (cnt--) {
+            ngx_keyval_t *keyval = ngx_array_push(context->attrs);
+            if (!keyval) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_array_push"); return NGX_ERROR; }
+            keyval->key = key;
+            ngx_memcpy(&len, p, sizeof(uint32_t));
+            p += sizeof(uint32_t);
+            keyval->value.len = len;
+            keyval->value.data = p;
+            p += len;
         }
-        ber_free(ber, 0);
     }
-    context->rc = NGX_OK;
+    return rc;
+}
+
+static void ngx_http_auth_basic_ldap_cache_set(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf = ngx_http_get_module_main_conf(r, ngx_http_auth_basic_ldap_module);
+    time_t valid = context->rc == NGX_OK ? location_conf->cache_valid : location_conf->cache_invalid;
+    if (!valid) return;
+    if (context->rc == NGX_OK && main_conf->generation && !context->groups && ngx_http_auth_basic_ldap_groups(r) != NGX_OK) return;
+    ngx_http_auth_basic_ldap_cache_t *cache = location_conf->cache->data;
+    ngx_uint_t ngroups = context->rc == NGX_OK && context->groups ? context->groups->nelts : 0;
+    ngx_keyval_t *elts = context->attrs ? context->attrs->elts : NULL;
+    ngx_uint_t nelts = context->attrs ? context->attrs->nelts : 0;
+    size_t size = 0;
+    for (ngx_uint_t i = 0; i < nelts; i++) {
+        if (!i || elts[i].key.data != elts[i - 1].key.data) size += sizeof(uint32_t) + elts[i].key.len + sizeof(uint32_t);
+        size += sizeof(uint32_t) + elts[i].value.len;
+    }
+    size_t n = offsetof(ngx_rbtree_node_t, color) + offsetof(ngx_http_auth_basic_ldap_cache_node_t, data) + size + sizeof(uint32_t) * ngroups + (ngroups ? NGX_ALIGNMENT + sizeof(ngx_http_auth_basic_ldap_cache_link_t) * ngroups : 0);
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_http_auth_basic_ldap_cache_expire(cache, 0);
+    ngx_http_auth_basic_ldap_cache_node_t *cache_node = ngx_http_auth_basic_ldap_cache_lookup(cache, context->key);
+    if (cache_node) ngx_http_auth_basic_ldap_cache_delete(cache, cache_node);
+    ngx_rbtree_node_t *node = ngx_slab_alloc_locked(cache->shpool, n);
+    if (!node) { ngx_http_auth_basic_ldap_cache_expire(cache, 1); node = ngx_slab_alloc_locked(cache->shpool, n); }
+    if (!node) { ngx_shmtx_unlock(&cache->shpool->mutex); ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: could not allocate node%s", cache->shpool->log_ctx); return; }
+    node->key = ngx_crc32_short(context->key, NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN);
+    cache_node = (ngx_http_auth_basic_ldap_cache_node_t *)&node->color;
+    cache_node->rc = (u_short)context->rc;
+    cache_node->dn_hash = context->dn_hash;
+    cache_node->dn_link.node.key = context->dn_hash;
+    cache_node->dn_link.cache_node = cache_node;
+    cache_node->generation = main_conf->generation;
+    cache_node->ngroups = (uint32_t)ngroups;
+    cache_node->expire = ngx_time() + valid;
+    cache_node->stale = cache_node->expire + location_conf->cache_stale;
+    cache_node->updating = 0;
+    cache_node->nelts = nelts;
+    cache_node->size = size;
+    ngx_memcpy(cache_node->key, context->key, NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN);
+    u_char *p = cache_node->data;
+    for (ngx_uint_t i = 0; i < nelts; i++) {
+        uint32_t len;
+        if (!i || elts[i].key.data != elts[i - 1].key.data) {
+            uint32_t cnt = 1;
+            while (i + cnt < nelts && elts[i + cnt].key.data == elts[i].key.data) cnt++;
+            len = elts[i].key.len;
+            p = ngx_cpymem(p, &len, sizeof(uint32_t));
+            p = ngx_cpymem(p, elts[i].key.data, len);
+            p = ngx_cpymem(p, &cnt, sizeof(uint32_t));
+        }
+        len = elts[i].value.len;
+        p = ngx_cpymem(p, &len, sizeof(uint32_t));
+        p = ngx_cpymem(p, elts[i].value.data, len);
+    }
+    if (ngroups) ngx_memcpy(p, context->groups->elts, sizeof(uint32_t) * ngroups);
+    ngx_rbtree_insert(&cache->sh->rbtree, node);
+    ngx_rbtree_insert(&cache->sh->dn_rbtree, &cache_node->dn_link.node);
+    ngx_http_auth_basic_ldap_cache_link_t *links = ngx_http_auth_basic_ldap_cache_links(cache_node);
+    uint32_t *ids = context->groups ? context->groups->elts : NULL;
+    for (ngx_uint_t i = 0; i < ngroups; i++) {
+        links[i].node.key = ids[i];
+        links[i].cache_node = cache_node;
+        ngx_rbtree_insert(&cache->sh->group_rbtree, &links[i].node);
+    }
+    ngx_queue_insert_head(&cache->sh->queue, &cache_node->queue);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+static void ngx_http_auth_basic_ldap_fail_key(u_char *secret, u_char type, ngx_str_t *value, u_char *key) {
+    ngx_md5_t md5;
+    u_char buf[64];
+    ngx_http_auth_basic_ldap_hmac_init(&md5, secret);
+    ngx_md5_update(&md5, &type, 1);
+    for (size_t i = 0; i < value->len; i += sizeof(buf)) {
+        size_t n = ngx_min(sizeof(buf), value->len - i);
+        ngx_strlow(buf, value->data + i, n);
+        ngx_md5_update(&md5, buf, n);
+    }
+    ngx_http_auth_basic_ldap_hmac_final(&md5, secret, key);
+}
+
+static ngx_uint_t ngx_http_auth_basic_ldap_fail_excess(ngx_http_auth_basic_ldap_fail_node_t *fail_node, ngx_uint_t rate, ngx_msec_t now) {
+    ngx_msec_int_t ms = (ngx_msec_int_t)(now - fail_node->last);
+    if (ms <= 0) return fail_node->excess;
+    ngx_uint_t decay = rate * (ngx_uint_t)ms / 1000;
+    return decay >= fail_node->excess ? 0 : fail_node->excess - decay;
+}
+
+static ngx_http_auth_basic_ldap_fail_node_t *ngx_http_auth_basic_ldap_fail_lookup(ngx_http_auth_basic_ldap_fail_t *fail, u_char *key) {
+    ngx_rbtree_key_t hash = ngx_crc32_short(key, NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN);
+    ngx_rbtree_node_t *node = fail->sh->rbtree.root;
+    ngx_rbtree_node_t *sentinel = fail->sh->rbtree.sentinel;
+    while (node != sentinel) {
+        if (hash < node->key) { node = node->left; continue; }
+        if (hash > node->key) { node = node->right; continue; }
+        ngx_http_auth_basic_ldap_fail_node_t *fail_node = (ngx_http_auth_basic_ldap_fail_node_t *)&node->color;
+        ngx_int_t rc = ngx_memcmp(key, fail_node->key, NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN);
+        if (!rc) return fail_node;
+        node = rc < 0 ? node->left : node->right;
+    }
+    return NULL;
+}
+
+static void ngx_http_auth_basic_ldap_fail_expire(ngx_http_auth_basic_ldap_fail_t *fail, ngx_uint_t rate, ngx_uint_t force) {
+    ngx_msec_t now = ngx_current_msec;
+    for (ngx_uint_t n = 0; n < 3; n++) {
+        if (ngx_queue_empty(&fail->sh->queue)) return;
+        ngx_http_auth_basic_ldap_fail_node_t *fail_node = ngx_queue_data(ngx_queue_last(&fail->sh->queue), ngx_http_auth_basic_ldap_fail_node_t, queue);
+        if (!force && ngx_http_auth_basic_ldap_fail_excess(fail_node, rate, now)) return;
+        force = 0;
+        ngx_queue_remove(&fail_node->queue);
+        ngx_rbtree_node_t *node = (ngx_rbtree_node_t *)((u_char *)fail_node - offsetof(ngx_rbtree_node_t, color));
+        ngx_rbtree_delete(&fail->sh->rbtree, node);
+        ngx_slab_free_locked(fail->shpool, node);
+    }
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_fail_limit(ngx_http_request_t *r, ngx_uint_t failed) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_fail_t *fail = location_conf->fail_limit->data;
+    u_char key[2][NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN];
+    ngx_http_auth_basic_ldap_fail_key(fail->sh->secret, 'u', &r->headers_in.user, key[0]);
+    ngx_http_auth_basic_ldap_fail_key(fail->sh->secret, 'a', &r->connection->addr_text, key[1]);
+    ngx_msec_t now = ngx_current_msec;
+    ngx_uint_t excess = 0;
+    ngx_shmtx_lock(&fail->shpool->mutex);
+    if (failed) ngx_http_auth_basic_ldap_fail_expire(fail, location_conf->fail_rate, 0);
+    for (ngx_uint_t i = 0; i < 2; i++) {
+        ngx_http_auth_basic_ldap_fail_node_t *fail_node = ngx_http_auth_basic_ldap_fail_lookup(fail, key[i]);
+        if (!fail_node && !failed) continue;
+        if (fail_node) { ngx_queue_remove(&fail_node->queue); } else {
+            size_t n = offsetof(ngx_rbtree_node_t, color) + sizeof(ngx_http_auth_basic_ldap_fail_node_t);
+            ngx_rbtree_node_t *node = ngx_slab_alloc_locked(fail->shpool, n);
+            if (!node) { ngx_http_auth_basic_ldap_fail_expire(fail, location_conf->fail_rate, 1); node = ngx_slab_alloc_locked(fail->shpool, n); }
+            if (!node) { ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: could not allocate node%s", fail->shpool->log_ctx); continue; }
+            node->key = ngx_crc32_short(key[i], NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN);
+            fail_node = (ngx_http_auth_basic_ldap_fail_node_t *)&node->color;
+            fail_node->last = now;
+            fail_node->excess = 0;
+            ngx_memcpy(fail_node->key, key[i], NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN);
+            ngx_rbtree_insert(&fail->sh->rbtree, node);
+        }
+        ngx_uint_t e = ngx_http_auth_basic_ldap_fail_excess(fail_node, location_conf->fail_rate, now);
+        if (failed) { fail_node->excess = e + 1000; fail_node->last = now; }
+        ngx_queue_insert_head(&fail->sh->queue, &fail_node->queue);
+        if (e > excess) excess = e;
+    }
+    ngx_shmtx_unlock(&fail->shpool->mutex);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: fail excess = %ui.%03ui", excess / 1000, excess % 1000);
+    if (failed || excess <= location_conf->fail_burst * 1000) return NGX_OK;
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: limiting authentication of user \"%V\", excess: %ui.%03ui by zone \"%V\"", &r->headers_in.user, excess / 1000, excess % 1000, &location_conf->fail_limit->shm.name);
+    return NGX_BUSY;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_headers(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    if (!location_conf->headers || context->background || !context->attrs || !context->attrs->nelts) return NGX_OK;
+    ngx_str_t header = ngx_null_string;
+    if (location_conf->header && ngx_http_complex_value(r, location_conf->header, &header) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_http_complex_value"); return NGX_ERROR; }
+    ngx_keyval_t *elts = context->attrs->elts;
+    ngx_str_t key = ngx_null_string;
+    u_char *lowcase_key = NULL;
+    ngx_uint_t hash = 0;
+    ngx_http_auth_basic_ldap_rule_t *rule = NULL;
+    for (ngx_uint_t i = 0; i < context->attrs->nelts; i++) {
+        if (!i || elts[i].key.data != elts[i - 1].key.data) {
+            rule = NULL;
+            if (location_conf->rules.buckets && elts[i].key.len <= NGX_HTTP_AUTH_BASIC_LDAP_ATTR_LEN) {
+                u_char name[NGX_HTTP_AUTH_BASIC_LDAP_ATTR_LEN];
+                rule = ngx_hash_find(&location_conf->rules, ngx_hash_strlow(name, elts[i].key.data, elts[i].key.len), name, elts[i].key.len);
+            }
+            if (rule && rule->key.data) { key = rule->key; lowcase_key = rule->lowcase_key; hash = rule->hash; } else {
+                key.len = header.len + elts[i].key.len;
+                if (!(key.data = ngx_pnalloc(r->pool, key.len))) { ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "!ngx_pnalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+                if (header.len) ngx_memcpy(key.data, header.data, header.len);
+                ngx_memcpy(key.data + header.len, elts[i].key.data, elts[i].key.len);
+                if (!(lowcase_key = ngx_pnalloc(r->pool, key.len))) { ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "!ngx_pnalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+                hash = ngx_hash_strlow(lowcase_key, key.data, key.len);
+            }
+        }
+        ngx_str_t value = elts[i].value;
+#if (NGX_PCRE)
+        if (rule) {
+            switch (ngx_http_regex_exec(r, rule->attr->http_regex, &value)) {
+                case NGX_ERROR: ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_regex_exec == NGX_ERROR"); return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                case NGX_DECLINED: ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: skip %V = %V", &elts[i].key, &elts[i].value); continue;
+            }
+            if (ngx_http_complex_value(r, &rule->attr->complex_value, &value) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        }
+#endif
+        ngx_table_elt_t *table_elt = ngx_list_push(&r->headers_in.headers);
+        if (!table_elt) { ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "!ngx_list_push"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        table_elt->hash = hash;
+        table_elt->key = key;
+        table_elt->value = value;
+        table_elt->lowcase_key = lowcase_key;
+#if (nginx_version >= 1023000)
+        table_elt->next = NULL;
+#endif
+    }
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_nested_search(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    struct berval dn = {context->dn.len, (char *)context->dn.data}, value;
+    if (ldap_bv2escaped_filter_value(&dn, &value)) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_bv2escaped_filter_value failed"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    u_char *filter = ngx_pnalloc(r->pool, sizeof("(member:" NGX_HTTP_AUTH_BASIC_LDAP_IN_CHAIN ":=)") + value.bv_len);
+    if (filter) (void) ngx_sprintf(filter, "(member:" NGX_HTTP_AUTH_BASIC_LDAP_IN_CHAIN ":=%*s)%Z", (size_t)value.bv_len, value.bv_val);
+    ber_memfree(value.bv_val);
+    if (!filter) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    if (!(context->groups = ngx_array_create(r->pool, 4, sizeof(uint32_t)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_array_create"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: filter = %s", filter);
+    char *attrs[] = {LDAP_NO_ATTRS, NULL};
+    int rc = ldap_search_ext(context->ldap, context->lud->lud_dn, LDAP_SCOPE_SUBTREE, (char *)filter, attrs, 0, NULL, NULL, NULL, 0, &context->msgid);
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_search_ext failed: %s", ldap_err2string(rc)); return NGX_ERROR; }
+    context->nesting = 1;
+    context->cacheable = 0;
+    context->keepalive = 0;
+    context->phase = ngx_current_msec;
+    ngx_add_timer(&context->event, location_conf->search_timeout);
+    return NGX_OK;
+rc_NGX_HTTP_INTERNAL_SERVER_ERROR:
+    context->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    return NGX_OK;
+}
+
+static void ngx_http_auth_basic_ldap_nested_entry(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    LDAPMessage *entry = ldap_first_entry(context->ldap, context->result);
+    if (!entry) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_first_entry failed"); return; }
+    char *dn = ldap_get_dn(context->ldap, entry);
+    if (!dn) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_get_dn failed"); return; }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: group = %s", dn);
+    if (ngx_http_auth_basic_ldap_group(r, context->groups, (u_char *)dn, ngx_strlen(dn)) == NGX_ERROR) context->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    ldap_memfree(dn);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_search_done(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    if (context->nesting) { context->nesting = 0; ngx_http_auth_basic_ldap_groups_sort(context->groups); }
+    else if (location_conf->nested_groups && context->dn.data && context->lud->lud_dn) return ngx_http_auth_basic_ldap_nested_search(r);
+    if ((context->rc = ngx_http_auth_basic_ldap_headers(r)) == NGX_OK) context->cacheable = 1;
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_bind(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    if (context->dn.data) return ngx_http_auth_basic_ldap_search_done(r);
+    if (!context->lud->lud_dn) { context->rc = NGX_OK; context->cacheable = 1; return NGX_OK; }
+    int rc = ldap_search_ext(context->ldap, context->lud->lud_dn, context->lud->lud_scope, context->lud->lud_filter, context->lud->lud_attrs, 0, NULL, NULL, NULL, 0, &context->msgid);
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_search_ext failed: %s", ldap_err2string(rc)); return NGX_ERROR; }
+    context->keepalive = 0;
+    context->phase = ngx_current_msec;
+    ngx_add_timer(&context->event, location_conf->search_timeout);
+    return NGX_OK;
+}
+
+static void ngx_http_auth_basic_ldap_entry_cleanup(void *data) {
+    ldap_msgfree(data);
+}
+
+static void ngx_http_auth_basic_ldap_search_entry(ngx_http_request_t *r, LDAP *ldap) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    BerElement *ber = NULL;
+    struct berval *vals = NULL;
+    if (context->entry) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: skip entry"); return; }
+    LDAPMessage *entry = ldap_first_entry(ldap, context->result);
+    if (!entry) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_first_entry failed"); goto ngx_http_auth_basic_ldap_set_realm; }
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (!cln) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pool_cleanup_add"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    cln->handler = ngx_http_auth_basic_ldap_entry_cleanup;
+    cln->data = context->entry = context->result;
+    context->result = NULL;
+    if (!(context->attrs = ngx_array_create(r->pool, 4, sizeof(ngx_keyval_t)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_array_create"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    struct berval bv;
+    int rc = ldap_get_dn_ber(ldap, entry, &ber, &bv);
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_get_dn_ber failed: %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_set_realm; }
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: dn = %*s", (size_t)bv.bv_len, bv.bv_val);
+    context->dn_hash = ngx_http_auth_basic_ldap_dn_hash((u_char *)bv.bv_val, bv.bv_len);
+    if (context->service || location_conf->nested_groups) {
+        context->dn.len = bv.bv_len;
+        if (!(context->dn.data = ngx_pnalloc(r->pool, context->dn.len + 1))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        (void) ngx_cpystrn(context->dn.data, (u_char *)bv.bv_val, context->dn.len + 1);
+    }
+    for (rc = ldap_get_attribute_ber(ldap, entry, ber, &bv, &vals); rc == LDAP_SUCCESS && bv.bv_val; rc = ldap_get_attribute_ber(ldap, entry, ber, &bv, &vals)) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: attr = %*s", (size_t)bv.bv_len, bv.bv_val);
+        if (!vals) continue;
+        for (struct berval *val = vals; val->bv_val; val++) {
+            ngx_keyval_t *keyval = ngx_array_push(context->attrs);
+            if (!keyval) { ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "!ngx_array_push"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
+            keyval->key.len = bv.bv_len;
+            keyval->key.data = (u_char *)bv.bv_val;
+            keyval->value.len = val->bv_len;
+            keyval->value.data = (u_char *)val->bv_val;
+            context->counters[NGX_HTTP_AUTH_BASIC_LDAP_BYTES] += val->bv_len;
+        }
+        ber_memfree(vals);
+        vals = NULL;
+    }
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_get_attribute_ber failed: %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_set_realm; }
+    ber_free(ber, 0);
     return;
 ngx_http_auth_basic_ldap_set_realm:
     context->rc = ngx_http_auth_basic_ldap_set_realm(r);
 free:
-    if (vals) ldap_value_free_len(vals);
-    if (attr) ldap_memfree(attr);
+    if (vals) ber_memfree(vals);
+    if (ber) ber_free(ber, 0);
+    return;
+rc_NGX_HTTP_INTERNAL_SERVER_ERROR:
+    context->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    goto free;
+}
+
+static void ngx_http_auth_basic_ldap_phase(ngx_http_auth_basic_ldap_context_t *context, ngx_uint_t phase) {
+    context->times[phase] = ngx_current_msec - context->phase;
+    context->timed |= 1 << phase;
+}
+
+static void ngx_http_auth_basic_ldap_message(ngx_http_auth_basic_ldap_context_t *context, int msgtype, int errcode) {
+    switch (msgtype) {
+        case LDAP_RES_BIND: context->counters[NGX_HTTP_AUTH_BASIC_LDAP_BIND_RESPONSES]++; ngx_http_auth_basic_ldap_phase(context, NGX_HTTP_AUTH_BASIC_LDAP_BIND); break;
+        case LDAP_RES_SEARCH_ENTRY: context->counters[NGX_HTTP_AUTH_BASIC_LDAP_SEARCH_ENTRIES]++; return;
+        case LDAP_RES_SEARCH_REFERENCE: context->counters[NGX_HTTP_AUTH_BASIC_LDAP_SEARCH_REFERENCES]++; return;
+        case LDAP_RES_SEARCH_RESULT: context->counters[NGX_HTTP_AUTH_BASIC_LDAP_SEARCH_RESULTS]++; ngx_http_auth_basic_ldap_phase(context, NGX_HTTP_AUTH_BASIC_LDAP_SEARCH); break;
+        default: context->counters[NGX_HTTP_AUTH_BASIC_LDAP_OTHER_RESPONSES]++; break;
+    }
+    context->counters[errcode == LDAP_SUCCESS ? NGX_HTTP_AUTH_BASIC_LDAP_SUCCESS : errcode == LDAP_INVALID_CREDENTIALS ? NGX_HTTP_AUTH_BASIC_LDAP_INVALID_CREDENTIALS : NGX_HTTP_AUTH_BASIC_LDAP_ERRORS]++;
+}
+
+static ngx_http_auth_basic_ldap_servers_node_t *ngx_http_auth_basic_ldap_servers_node(ngx_http_auth_basic_ldap_servers_t *servers, ngx_addr_t *addr) {
+    ngx_rbtree_key_t hash = ngx_crc32_short((u_char *)addr->sockaddr, addr->socklen);
+    ngx_rbtree_node_t *node = servers->sh->rbtree.root;
+    ngx_rbtree_node_t *sentinel = servers->sh->rbtree.sentinel;
+    while (node != sentinel) {
+        if (hash < node->key) { node = node->left; continue; }
+        if (hash > node->key) { node = node->right; continue; }
+        ngx_http_auth_basic_ldap_servers_node_t *servers_node = (ngx_http_auth_basic_ldap_servers_node_t *)&node->color;
+        ngx_int_t rc = ngx_memn2cmp((u_char *)addr->sockaddr, servers_node->sockaddr, addr->socklen, servers_node->socklen);
+        if (!rc) return servers_node;
+        node = rc < 0 ? node->left : node->right;
+    }
+    if (!(node = ngx_slab_calloc_locked(servers->shpool, offsetof(ngx_rbtree_node_t, color) + offsetof(ngx_http_auth_basic_ldap_servers_node_t, sockaddr) + addr->socklen))) return NULL;
+    node->key = hash;
+    ngx_http_auth_basic_ldap_servers_node_t *servers_node = (ngx_http_auth_basic_ldap_servers_node_t *)&node->color;
+    servers_node->socklen = (u_short)addr->socklen;
+    ngx_memcpy(servers_node->sockaddr, addr->sockaddr, addr->socklen);
+    ngx_rbtree_insert(&servers->sh->rbtree, node);
+    return servers_node;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_servers_get(ngx_http_request_t *r) {
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    if (!location_conf->servers) { context->addr = context->tries ? (context->addr + 1) % context->naddrs : ngx_random() % context->naddrs; return NGX_OK; }
+    ngx_uint_t n = (context->naddrs + (8 * sizeof(uintptr_t) - 1)) / (8 * sizeof(uintptr_t));
+    if (!context->tried && !(context->tried = ngx_pcalloc(r->pool, n * sizeof(uintptr_t)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_ERROR; }
+    if (context->tries && !(context->tries % context->naddrs)) ngx_memzero(context->tried, n * sizeof(uintptr_t));
+    ngx_http_auth_basic_ldap_servers_t *servers = location_conf->servers->data;
+    time_t now = ngx_time();
+    ngx_uint_t offset = context->naddrs == 1 ? 0 : ngx_random() % context->naddrs;
+    ngx_http_auth_basic_ldap_servers_node_t *best = NULL;
+    ngx_uint_t best_addr = context->naddrs;
+    ngx_uint_t best_score = 0;
+    ngx_uint_t best_down = 1;
+    ngx_shmtx_lock(&servers->shpool->mutex);
+    for (ngx_uint_t j = 0; j < context->naddrs; j++) {
+        ngx_uint_t i = (offset + j) % context->naddrs;
+        if (context->tried[i / (8 * sizeof(uintptr_t))] & ((uintptr_t)1 << i % (8 * sizeof(uintptr_t)))) continue;
+        ngx_http_auth_basic_ldap_servers_node_t *node = ngx_http_auth_basic_ldap_servers_node(servers, &context->addrs[i]);
+        ngx_uint_t down = node && location_conf->max_fails && node->fails >= location_conf->max_fails && (now - node->checked <= location_conf->fail_timeout || node->probe);
+        ngx_uint_t score = node ? (node->ewma + 1) * (node->outstanding + 1) : 1;
+        if (best_addr < context->naddrs && (down > best_down || (down == best_down && score >= best_score))) continue;
+        best = node;
+        best_addr = i;
+        best_score = score;
+        best_down = down;
+    }
+    if (best_addr == context->naddrs) { ngx_shmtx_unlock(&servers->shpool->mutex); return NGX_DECLINED; }
+    if (best_down) ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: all LDAP servers are down, trying \"%V\"", &context->addrs[best_addr].name);
+    if (best) {
+        best->outstanding++;
+        context->probe = location_conf->max_fails && best->fails >= location_conf->max_fails && !best->probe;
+        if (context->probe) best->probe = 1;
+    }
+    ngx_shmtx_unlock(&servers->shpool->mutex);
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: server \"%V\" score = %ui, probe = %ui", &context->addrs[best_addr].name, best_score, (ngx_uint_t)context->probe);
+    context->tried[best_addr / (8 * sizeof(uintptr_t))] |= (uintptr_t)1 << best_addr % (8 * sizeof(uintptr_t));
+    context->addr = best_addr;
+    context->server = best;
+    context->servers = servers;
+    context->start = ngx_current_msec;
+    return NGX_OK;
+}
+
+static void ngx_http_auth_basic_ldap_servers_free(ngx_http_auth_basic_ldap_context_t *context, ngx_int_t rc) {
+    ngx_http_auth_basic_ldap_servers_node_t *node = context->server;
+    if (!node) return;
+    ngx_http_auth_basic_ldap_servers_t *servers = context->servers;
+    ngx_msec_t ewma = (ngx_current_msec - context->start) * NGX_HTTP_AUTH_BASIC_LDAP_EWMA_SCALE;
+    ngx_shmtx_lock(&servers->shpool->mutex);
+    node->outstanding--;
+    if (context->probe) node->probe = 0;
+    switch (rc) {
+        case NGX_OK: node->fails = 0; node->ewma = ewma > node->ewma ? ewma : node->ewma - (node->ewma - ewma) / 8; break;
+        case NGX_ERROR: node->fails++; node->checked = ngx_time(); node->counters[NGX_HTTP_AUTH_BASIC_LDAP_FAILURES]++; break;
+    }
+    for (ngx_uint_t i = 0; i < NGX_HTTP_AUTH_BASIC_LDAP_PHASES; i++) {
+        if (!(context->timed & (1 << i))) continue;
+        ngx_uint_t j = 0;
+        while (j < NGX_HTTP_AUTH_BASIC_LDAP_BUCKETS - 1 && context->times[i] > ngx_http_auth_basic_ldap_buckets[j]) j++;
+        node->buckets[i][j]++;
+        node->sum[i] += context->times[i];
+    }
+    for (ngx_uint_t i = 0; i < NGX_HTTP_AUTH_BASIC_LDAP_COUNTERS; i++) node->counters[i] += context->counters[i];
+    ngx_shmtx_unlock(&servers->shpool->mutex);
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, context->request->connection->log, 0, "ldap: server \"%V\" rc = %i, ewma = %M", context->peer_connection.name, rc, node->ewma);
+    context->server = NULL;
+    context->probe = 0;
+    context->timed = 0;
+    ngx_memzero(context->counters, sizeof(context->counters));
+}
+
+#if (NGX_SSL)
+static int ngx_http_auth_basic_ldap_sb_setup(Sockbuf_IO_Desc *sbiod, void *arg) {
+    sbiod->sbiod_pvt = arg;
+    return 0;
+}
+
+static int ngx_http_auth_basic_ldap_sb_remove(Sockbuf_IO_Desc *sbiod) {
+    sbiod->sbiod_pvt = NULL;
+    return 0;
+}
+
+static int ngx_http_auth_basic_ldap_sb_ctrl(Sockbuf_IO_Desc *sbiod, int opt, void *arg) {
+    ngx_connection_t *c = sbiod->sbiod_pvt;
+    if (opt == LBER_SB_OPT_DATA_READY && c && c->ssl && SSL_pending(c->ssl->connection) > 0) return 1;
+    return LBER_SBIOD_CTRL_NEXT(sbiod, opt, arg);
+}
+
+static ber_slen_t ngx_http_auth_basic_ldap_sb_read(Sockbuf_IO_Desc *sbiod, void *buf, ber_len_t len) {
+    ngx_connection_t *c = sbiod->sbiod_pvt;
+    if (!c || !c->ssl) { ngx_set_socket_errno(NGX_ECONNRESET); return -1; }
+    ssize_t n = c->recv(c, buf, len);
+    if (n == NGX_AGAIN) { ngx_set_socket_errno(NGX_EAGAIN); return -1; }
+    if (n == NGX_ERROR) { ngx_set_socket_errno(NGX_ECONNRESET); return -1; }
+    return n;
+}
+
+static ber_slen_t ngx_http_auth_basic_ldap_sb_write(Sockbuf_IO_Desc *sbiod, void *buf, ber_len_t len) {
+    ngx_connection_t *c = sbiod->sbiod_pvt;
+    if (!c || !c->ssl) { ngx_set_socket_errno(NGX_ECONNRESET); return -1; }
+    ssize_t n = c->send(c, buf, len);
+    if (n == NGX_AGAIN) { ngx_set_socket_errno(NGX_EAGAIN); return -1; }
+    if (n == NGX_ERROR) { ngx_set_socket_errno(NGX_ECONNRESET); return -1; }
+    return n;
+}
+
+static int ngx_http_auth_basic_ldap_sb_close(Sockbuf_IO_Desc *sbiod) {
+    return 0;
+}
+
+static Sockbuf_IO ngx_http_auth_basic_ldap_sbio = {
+    .sbi_setup = ngx_http_auth_basic_ldap_sb_setup,
+    .sbi_remove = ngx_http_auth_basic_ldap_sb_remove,
+    .sbi_ctrl = ngx_http_auth_basic_ldap_sb_ctrl,
+    .sbi_read = ngx_http_auth_basic_ldap_sb_read,
+    .sbi_write = ngx_http_auth_basic_ldap_sb_write,
+    .sbi_close = ngx_http_auth_basic_ldap_sb_close
+};
+
+static void ngx_http_auth_basic_ldap_ssl_session_save(ngx_http_auth_basic_ldap_servers_t *servers, ngx_connection_t *c) {
+    SSL_SESSION *session = ngx_ssl_get0_session(c);
+    if (!session) return;
+    int len = i2d_SSL_SESSION(session, NULL);
+    if (len <= 0 || len > NGX_SSL_MAX_SESSION_SIZE) return;
+    u_char buf[NGX_SSL_MAX_SESSION_SIZE];
+    u_char *p = buf;
+    (void) i2d_SSL_SESSION(session, &p);
+    ngx_addr_t addr = {c->sockaddr, c->socklen, ngx_null_string};
+    ngx_shmtx_lock(&servers->shpool->mutex);
+    ngx_http_auth_basic_ldap_servers_node_t *node = ngx_http_auth_basic_ldap_servers_node(servers, &addr);
+    if (node && (size_t)len > node->ssl_session_len) {
+        if (node->ssl_session) ngx_slab_free_locked(servers->shpool, node->ssl_session);
+        node->ssl_session_len = 0;
+        node->ssl_session = ngx_slab_alloc_locked(servers->shpool, len);
+    }
+    if (node && node->ssl_session) { node->ssl_session_len = len; ngx_memcpy(node->ssl_session, buf, len); }
+    ngx_shmtx_unlock(&servers->shpool->mutex);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "ldap: save session len = %d", len);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_ssl_session_set(ngx_http_auth_basic_ldap_servers_t *servers, ngx_connection_t *c) {
+    u_char buf[NGX_SSL_MAX_SESSION_SIZE];
+    size_t len = 0;
+    ngx_addr_t addr = {c->sockaddr, c->socklen, ngx_null_string};
+    ngx_shmtx_lock(&servers->shpool->mutex);
+    ngx_http_auth_basic_ldap_servers_node_t *node = ngx_http_auth_basic_ldap_servers_node(servers, &addr);
+    if (node && node->ssl_session && node->ssl_session_len) ngx_memcpy(buf, node->ssl_session, len = node->ssl_session_len);
+    ngx_shmtx_unlock(&servers->shpool->mutex);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "ldap: set session len = %uz", len);
+    if (!len) return NGX_OK;
+    const u_char *p = buf;
+    SSL_SESSION *session = d2i_SSL_SESSION(NULL, &p, len);
+    if (!session) return NGX_OK;
+    ngx_int_t rc = ngx_ssl_set_session(c, session);
+    ngx_ssl_free_session(session);
+    return rc;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_ssl_connection(ngx_connection_t *c, ngx_http_auth_basic_ldap_location_conf_t *location_conf, ngx_ssl_t *ssl, ngx_str_t *name, ngx_connection_handler_pt save_session) {
+    if (!c->pool && !(c->pool = ngx_create_pool(128, ngx_cycle->log))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_create_pool"); return NGX_ERROR; }
+    if (ngx_ssl_create_connection(ssl, c, NGX_SSL_CLIENT) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_ssl_create_connection != NGX_OK"); return NGX_ERROR; }
+    if (location_conf->ssl_server_name && name->len && ngx_inet_addr(name->data, name->len) == INADDR_NONE && !ngx_strlchr(name->data, name->data + name->len, ':') && !SSL_set_tlsext_host_name(c->ssl->connection, (char *)name->data)) { ngx_ssl_error(NGX_LOG_ERR, c->log, 0, "ldap: SSL_set_tlsext_host_name(\"%V\") failed", name); return NGX_ERROR; }
+    if (!location_conf->ssl_session_reuse || !location_conf->servers) return NGX_OK;
+    c->ssl->save_session = save_session;
+    return ngx_http_auth_basic_ldap_ssl_session_set(location_conf->servers->data, c);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_ssl_done(ngx_connection_t *c, ngx_http_auth_basic_ldap_location_conf_t *location_conf, ngx_str_t *name, LDAP *ldap) {
+    if (!c->ssl->handshaked) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ldap: SSL handshake with LDAP server \"%V\" failed", name); return NGX_ERROR; }
+    if (location_conf->ssl_verify) {
+        long rc = SSL_get_verify_result(c->ssl->connection);
+        if (rc != X509_V_OK) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ldap: LDAP server SSL certificate verify error: (%l:%s)", rc, X509_verify_cert_error_string(rc)); return NGX_ERROR; }
+        if (ngx_ssl_check_host(c, name) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ldap: LDAP server SSL certificate does not match \"%V\"", name); return NGX_ERROR; }
+    }
+    Sockbuf *sb;
+    if (ldap_get_option(ldap, LDAP_OPT_SOCKBUF, &sb) != LDAP_OPT_SUCCESS) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ldap: ldap_get_option(LDAP_OPT_SOCKBUF) failed"); return NGX_ERROR; }
+    if (ber_sockbuf_add_io(sb, &ngx_http_auth_basic_ldap_sbio, LBER_SBIOD_LEVEL_TRANSPORT, c)) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ldap: ber_sockbuf_add_io failed"); return NGX_ERROR; }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "ldap: SSL reused = %d", SSL_session_reused(c->ssl->connection));
+    return NGX_OK;
+}
+
+static ngx_str_t ngx_http_auth_basic_ldap_ssl_name(ngx_http_auth_basic_ldap_location_conf_t *location_conf, LDAPURLDesc *lud) {
+    if (location_conf->ssl_name.len || !lud->lud_host) return location_conf->ssl_name;
+    return (ngx_str_t){ngx_strlen(lud->lud_host), (u_char *)lud->lud_host};
+}
+#endif
+
+static void ngx_http_auth_basic_ldap_close(ngx_connection_t *c, LDAP *ldap) {
+#if (NGX_SSL)
+    if (c->ssl) {
+        Sockbuf *sb;
+        if (ldap && ldap_get_option(ldap, LDAP_OPT_SOCKBUF, &sb) == LDAP_OPT_SUCCESS) (void) ber_sockbuf_remove_io(sb, &ngx_http_auth_basic_ldap_sbio, LBER_SBIOD_LEVEL_TRANSPORT);
+        c->ssl->no_wait_shutdown = 1;
+        (void) ngx_ssl_shutdown(c);
+    }
+    if (c->pool) { ngx_destroy_pool(c->pool); c->pool = NULL; }
+#endif
+    ngx_close_connection(c);
+    if (ldap) ldap_unbind_ext(ldap, NULL, NULL);
+}
+
+static void ngx_http_auth_basic_ldap_keepalive_close(ngx_http_auth_basic_ldap_keepalive_t *keepalive) {
+    ngx_queue_remove(&keepalive->queue);
+    ngx_queue_insert_head(&keepalive->main_conf->free, &keepalive->queue);
+    ngx_http_auth_basic_ldap_close(keepalive->connection, keepalive->ldap);
+    keepalive->connection = NULL;
+    keepalive->ldap = NULL;
+}
+
+static void ngx_http_auth_basic_ldap_keepalive_dummy_handler(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__);
+}
+
+static void ngx_http_auth_basic_ldap_keepalive_close_handler(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__);
+    ngx_connection_t *c = ev->data;
+    if (c->close || c->read->timedout) goto close;
+    char buf[1];
+#if (NGX_SSL)
+    if (c->ssl) {
+        ERR_clear_error();
+        int n = SSL_peek(c->ssl->connection, buf, 1);
+        if (n > 0 || SSL_get_error(c->ssl->connection, n) != SSL_ERROR_WANT_READ) goto close;
+        ev->ready = 0;
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) goto close;
+        return;
+    }
+#endif
+    ssize_t n = recv(c->fd, buf, 1, MSG_PEEK);
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) goto close;
+        return;
+    }
+close:
+    ngx_http_auth_basic_ldap_keepalive_close(c->data);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_keepalive_get(ngx_http_request_t *r) {
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf = ngx_http_get_module_main_conf(r, ngx_http_auth_basic_ldap_module);
+    if (!main_conf->keepalive) return NGX_DECLINED;
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    for (ngx_queue_t *q = ngx_queue_head(&main_conf->cache); q != ngx_queue_sentinel(&main_conf->cache); q = ngx_queue_next(q)) {
+        ngx_http_auth_basic_ldap_keepalive_t *keepalive = ngx_queue_data(q, ngx_http_auth_basic_ldap_keepalive_t, queue);
+        if (ngx_memn2cmp((u_char *)keepalive->sockaddr, (u_char *)context->peer_connection.sockaddr, keepalive->socklen, context->peer_connection.socklen)) continue;
+#if (NGX_SSL)
+        if (keepalive->ssl != context->ssl) continue;
+#endif
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&main_conf->free, q);
+        ngx_connection_t *c = keepalive->connection;
+        if (c->read->timer_set) ngx_del_timer(c->read);
+        c->idle = 0;
+        context->peer_connection.connection = c;
+        context->peer_connection.cached = 1;
+        context->ldap = keepalive->ldap;
+        keepalive->connection = NULL;
+        keepalive->ldap = NULL;
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: get keepalive connection %p", c);
+        return NGX_OK;
+    }
+    return NGX_DECLINED;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_keepalive_put(ngx_http_request_t *r) {
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf = ngx_http_get_module_main_conf(r, ngx_http_auth_basic_ldap_module);
+    if (!main_conf->keepalive) return NGX_DECLINED;
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_connection_t *c = context->peer_connection.connection;
+    if (c->read->eof || c->read->error || c->read->timedout || c->write->error || c->write->timedout) return NGX_DECLINED;
+#if (NGX_SSL)
+    if (context->ssl && (!c->ssl || !c->ssl->handshaked)) return NGX_DECLINED;
+#endif
+    if (c->read->timer_set) ngx_del_timer(c->read);
+    if (c->write->timer_set) ngx_del_timer(c->write);
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) return NGX_DECLINED;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: put keepalive connection %p", c);
+    if (ngx_queue_empty(&main_conf->free)) ngx_http_auth_basic_ldap_keepalive_close(ngx_queue_data(ngx_queue_last(&main_conf->cache), ngx_http_auth_basic_ldap_keepalive_t, queue));
+    ngx_queue_t *q = ngx_queue_head(&main_conf->free);
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(&main_conf->cache, q);
+    ngx_http_auth_basic_ldap_keepalive_t *keepalive = ngx_queue_data(q, ngx_http_auth_basic_ldap_keepalive_t, queue);
+    keepalive->connection = c;
+    keepalive->ldap = context->ldap;
+#if (NGX_SSL)
+    keepalive->ssl = context->ssl;
+    if (c->ssl) c->ssl->save_session = NULL;
+#endif
+    keepalive->socklen = context->peer_connection.socklen;
+    ngx_memcpy(keepalive->sockaddr, context->peer_connection.sockaddr, context->peer_connection.socklen);
+    ngx_add_timer(c->read, main_conf->keepalive_timeout);
+    c->read->handler = ngx_http_auth_basic_ldap_keepalive_close_handler;
+    c->write->handler = ngx_http_auth_basic_ldap_keepalive_dummy_handler;
+    c->data = keepalive;
+    c->idle = 1;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+    context->peer_connection.connection = NULL;
+    context->ldap = NULL;
+    if (c->read->ready) ngx_http_auth_basic_ldap_keepalive_close_handler(c->read);
+    return NGX_OK;
+}
+
+static void ngx_http_auth_basic_ldap_wake(ngx_http_request_t *r) {
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    if (!context->background) { ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: Waking authentication request \"%V\"", &r->request_line); ngx_http_core_run_phases(r); return; }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: background update = %i", context->rc);
+    if (context->cacheable) { ngx_http_auth_basic_ldap_cache_set(r); context->cacheable = 0; }
+    ngx_http_auth_basic_ldap_release(context);
+    ngx_http_finalize_request(r, NGX_DONE);
+}
+
+static void ngx_http_auth_basic_ldap_read_handler(ngx_event_t *ev) {
+    ngx_connection_t *c = ev->data;
+    ngx_http_request_t *r = c->data;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    if (!context->ldap) return;
+    if (context->rc != NGX_AGAIN) return;
+    char *errmsg = NULL;
+    struct timeval timeout = {0, 0};
+    int errcode;
+ldap_result:
+    if (context->result) { ldap_msgfree(context->result); context->result = NULL; }
+    int rc = ldap_result(context->ldap, context->msgid, 0, &timeout, &context->result);
+    if (!rc) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: ldap_result = 0"); goto ngx_handle_read_event; }
+    if (rc < 0) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_result failed: %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_retry; }
+    switch ((rc = ldap_parse_result(context->ldap, context->result, &errcode, NULL, &errmsg, NULL, NULL, 0))) {
+        case LDAP_SUCCESS: context->keepalive = 1; break;
+        case LDAP_NO_RESULTS_RETURNED: break;
+        default: ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_parse_result failed:  %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_retry;
+    }
+    ngx_http_auth_basic_ldap_message(context, ldap_msgtype(context->result), errcode);
+    if (errcode == LDAP_UNAVAILABLE || errcode == LDAP_BUSY) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: %s [%s]", ldap_err2string(errcode), errmsg ? errmsg : "-"); goto ngx_http_auth_basic_ldap_retry; }
+    context->responded = 1;
+    if (errcode != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: %s [%s]", ldap_err2string(errcode), errmsg ? errmsg : "-"); if (errcode == LDAP_INVALID_CREDENTIALS) context->cacheable = 1; goto ngx_http_auth_basic_ldap_set_realm; }
+    switch ((rc = ldap_msgtype(context->result))) {
+        case LDAP_RES_BIND: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: LDAP_RES_BIND"); if (ngx_http_auth_basic_ldap_bind(r) != NGX_OK) goto ngx_http_auth_basic_ldap_retry; break;
+        case LDAP_RES_SEARCH_ENTRY: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: LDAP_RES_SEARCH_ENTRY"); if (context->nesting) ngx_http_auth_basic_ldap_nested_entry(r); else ngx_http_auth_basic_ldap_search_entry(r, context->ldap); break;
+        case LDAP_RES_SEARCH_REFERENCE: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: LDAP_RES_SEARCH_REFERENCE"); break;
+        case LDAP_RES_SEARCH_RESULT: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: LDAP_RES_SEARCH_RESULT"); if (!context->nesting && !context->attrs) { context->cacheable = 1; goto ngx_http_auth_basic_ldap_set_realm; } if (ngx_http_auth_basic_ldap_search_done(r) != NGX_OK) goto ngx_http_auth_basic_ldap_retry; break;
+        case LDAP_RES_MODIFY: ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: LDAP_RES_MODIFY"); goto ngx_http_auth_basic_ldap_set_realm;
+        case LDAP_RES_ADD: ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: LDAP_RES_ADD"); goto ngx_http_auth_basic_ldap_set_realm;
+        case LDAP_RES_DELETE: ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: LDAP_RES_DELETE"); goto ngx_http_auth_basic_ldap_set_realm;
+        case LDAP_RES_MODDN: ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: LDAP_RES_MODDN"); goto ngx_http_auth_basic_ldap_set_realm;
+        case LDAP_RES_COMPARE: ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: LDAP_RES_COMPARE"); goto ngx_http_auth_basic_ldap_set_realm;
+        case LDAP_RES_EXTENDED:
+#if (NGX_SSL)
+            if (context->starttls && !c->ssl) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: LDAP_RES_EXTENDED StartTLS"); if (errmsg) ldap_memfree(errmsg); ngx_http_auth_basic_ldap_ssl_handshake(r); return; }
+#endif
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: LDAP_RES_EXTENDED"); goto ngx_http_auth_basic_ldap_set_realm;
+        case LDAP_RES_INTERMEDIATE: ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: LDAP_RES_INTERMEDIATE"); goto ngx_http_auth_basic_ldap_set_realm;
+        default: ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: unknown ldap_msgtype %d", rc); goto ngx_http_auth_basic_ldap_set_realm;
+    }
+ngx_http_core_run_phases:
+    if (errmsg) { ldap_memfree(errmsg); errmsg = NULL; }
+    if (context->rc == NGX_AGAIN) goto ldap_result;
+ngx_handle_read_event:
+    if (ngx_handle_read_event(ev, 0) != NGX_OK) context->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (context->rc != NGX_AGAIN) ngx_http_auth_basic_ldap_wake(r);
+    return;
+ngx_http_auth_basic_ldap_set_realm:
+    context->rc = ngx_http_auth_basic_ldap_set_realm(r);
+    goto ngx_http_core_run_phases;
+ngx_http_auth_basic_ldap_retry:
+    if (errmsg) ldap_memfree(errmsg);
+    ngx_http_auth_basic_ldap_retry(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    if (context->rc != NGX_AGAIN) ngx_http_auth_basic_ldap_wake(r);
+}
+
+static u_char *ngx_http_auth_basic_ldap_domain(u_char *p, const char *q) {
+    while (*q) {
+        switch (q[0]) {
+            case 'D': case 'd': if (q[1]) switch (q[1]) {
+                case 'C': case 'c': if (q[2]) switch (q[2]) {
+                    case '=': q += 3; continue;
+                } break;
+            } break;
+            case ',': *p++ = '.'; q++; continue;
+        }
+        *p++ = *q++;
+    }
+    return p;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_sasl_bind(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_str_t bind;
+    u_char *dn = context->dn.data;
+    if (dn) goto ldap_sasl_bind;
+    if (!location_conf->bind) bind.len = r->headers_in.user.len + (context->lud_static ? location_conf->domain.len : sizeof("@") - 1 + ngx_strlen(context->lud->lud_dn));
+    else if (ngx_http_complex_value(r, location_conf->bind, &bind) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); goto rc_NGX_ERROR; }
+    if (!(dn = ngx_pnalloc(r->pool, bind.len + 1))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    if (location_conf->bind) (void) ngx_cpystrn(dn, bind.data, bind.len + 1); else {
+        u_char *p = ngx_copy(dn, r->headers_in.user.data, r->headers_in.user.len);
+        if (context->lud_static) p = ngx_copy(p, location_conf->domain.data, location_conf->domain.len); else { *p++ = '@'; p = ngx_http_auth_basic_ldap_domain(p, context->lud->lud_dn); }
+        *p = '\0';
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: dn = %s", dn);
+    }
+ldap_sasl_bind:;
+    struct berval cred = {r->headers_in.passwd.len, (char *)r->headers_in.passwd.data};
+    int rc = ldap_sasl_bind(context->ldap, (const char *)dn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, &context->msgid);
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_sasl_bind failed: %s", ldap_err2string(rc)); return NGX_ERROR; }
+    context->keepalive = 0;
+    context->phase = ngx_current_msec;
+    ngx_add_timer(&context->event, location_conf->bind_timeout);
+    return NGX_OK;
+rc_NGX_HTTP_INTERNAL_SERVER_ERROR:
+    context->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    return NGX_OK;
+rc_NGX_ERROR:
+    context->rc = NGX_ERROR;
+    return NGX_OK;
+}
+
+static void ngx_http_auth_basic_ldap_service_detach(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_service_t *service = context->service;
+    if (context->waiting) { ngx_queue_remove(&context->queue); } else ngx_rbtree_delete(&service->rbtree, &context->node);
+    context->waiting = 0;
+    context->service = NULL;
+    if (!--service->requests) service->peer_connection.connection->idle = 1;
+}
+
+static void ngx_http_auth_basic_ldap_retry(ngx_http_request_t *r, ngx_int_t rc) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    if (context->service) { if (!context->waiting) (void) ldap_abandon_ext(context->service->ldap, context->msgid, NULL, NULL); ngx_http_auth_basic_ldap_service_detach(r); }
+    if (context->result) { ldap_msgfree(context->result); context->result = NULL; }
+    context->entry = NULL;
+    if (context->peer_connection.connection) { ngx_http_auth_basic_ldap_close(context->peer_connection.connection, context->ldap); context->peer_connection.connection = NULL; context->ldap = NULL; }
+    if (context->ldap) { ldap_unbind_ext(context->ldap, NULL, NULL); context->ldap = NULL; }
+    context->attrs = NULL;
+    context->groups = NULL;
+    context->nesting = 0;
+    ngx_str_null(&context->dn);
+    context->dn_hash = 0;
+    context->cacheable = 0;
+    context->keepalive = 0;
+    context->responded = 0;
+    ngx_http_auth_basic_ldap_servers_free(context, NGX_ERROR);
+    if (ngx_http_auth_basic_ldap_start(r) != NGX_OK) context->rc = rc;
+}
+
+#if (NGX_SSL)
+static void ngx_http_auth_basic_ldap_ssl_save_session(ngx_connection_t *c) {
+    ngx_http_request_t *r = c->data;
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_ssl_session_save(location_conf->servers->data, c);
+}
+
+static void ngx_http_auth_basic_ldap_ssl_handshaked(ngx_connection_t *c) {
+    ngx_http_request_t *r = c->data;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_str_t name = ngx_http_auth_basic_ldap_ssl_name(location_conf, context->lud);
+    if (ngx_http_auth_basic_ldap_ssl_done(c, location_conf, &name, context->ldap) != NGX_OK) { ngx_http_auth_basic_ldap_retry(r, NGX_HTTP_INTERNAL_SERVER_ERROR); goto ngx_http_core_run_phases; }
+    c->read->handler = ngx_http_auth_basic_ldap_read_handler;
+    c->write->handler = ngx_http_auth_basic_ldap_write_handler;
+    ngx_http_auth_basic_ldap_phase(context, NGX_HTTP_AUTH_BASIC_LDAP_CONNECT);
+    if (ngx_http_auth_basic_ldap_sasl_bind(r) != NGX_OK) { ngx_http_auth_basic_ldap_retry(r, NGX_HTTP_INTERNAL_SERVER_ERROR); goto ngx_http_core_run_phases; }
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK || ngx_handle_write_event(c->write, 0) != NGX_OK) context->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+ngx_http_core_run_phases:
+    if (context->rc != NGX_AGAIN) ngx_http_auth_basic_ldap_wake(r);
+}
+
+static void ngx_http_auth_basic_ldap_ssl_handshake(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_connection_t *c = context->peer_connection.connection;
+    ngx_str_t name = ngx_http_auth_basic_ldap_ssl_name(location_conf, context->lud);
+    if (ngx_http_auth_basic_ldap_ssl_connection(c, location_conf, context->ssl, &name, ngx_http_auth_basic_ldap_ssl_save_session) != NGX_OK) { context->rc = NGX_HTTP_INTERNAL_SERVER_ERROR; ngx_http_auth_basic_ldap_wake(r); return; }
+    if (ngx_ssl_handshake(c) == NGX_AGAIN) { c->ssl->handler = ngx_http_auth_basic_ldap_ssl_handshaked; return; }
+    ngx_http_auth_basic_ldap_ssl_handshaked(c);
+}
+#endif
+
+static ngx_int_t ngx_http_auth_basic_ldap_test_connect(ngx_connection_t *c) {
+    ngx_err_t err = 0;
+#if (NGX_HAVE_KQUEUE)
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+        if (c->write->pending_eof || c->read->pending_eof) err = c->write->pending_eof ? c->write->kq_errno : c->read->kq_errno;
+    } else
+#endif
+    {
+        socklen_t len = sizeof(int);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *)&err, &len) == -1) err = ngx_socket_errno;
+    }
+    if (!err) return NGX_OK;
+    (void) ngx_connection_error(c, err, "ldap: connect() to LDAP server failed");
+    return NGX_ERROR;
+}
+
+static void ngx_http_auth_basic_ldap_write_handler(ngx_event_t *ev) {
+    ngx_connection_t *c = ev->data;
+    ngx_http_request_t *r = c->data;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    if (context->ldap) return;
+    if (context->rc != NGX_AGAIN) return;
+    if (ngx_http_auth_basic_ldap_test_connect(c) != NGX_OK) goto ngx_http_auth_basic_ldap_retry;
+    int rc = ldap_init_fd(c->fd, LDAP_PROTO_TCP, NULL, &context->ldap);
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_init_fd failed: %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_retry; }
+#if (NGX_SSL)
+    if (context->starttls) {
+        if ((rc = ldap_extended_operation(context->ldap, LDAP_EXOP_START_TLS, NULL, NULL, NULL, &context->msgid)) != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_extended_operation failed: %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_retry; }
+        goto ngx_http_core_run_phases;
+    }
+    if (context->ssl) { ngx_http_auth_basic_ldap_ssl_handshake(r); return; }
+#endif
+    ngx_http_auth_basic_ldap_phase(context, NGX_HTTP_AUTH_BASIC_LDAP_CONNECT);
+    if (ngx_http_auth_basic_ldap_sasl_bind(r) != NGX_OK) goto ngx_http_auth_basic_ldap_retry;
+ngx_http_core_run_phases:
+    if (ngx_handle_write_event(ev, 0) != NGX_OK) context->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (context->rc != NGX_AGAIN) ngx_http_auth_basic_ldap_wake(r);
+    return;
+ngx_http_auth_basic_ldap_retry:
+    ngx_http_auth_basic_ldap_retry(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    if (context->rc != NGX_AGAIN) ngx_http_auth_basic_ldap_wake(r);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_connect(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    if (ngx_http_auth_basic_ldap_keepalive_get(r) != NGX_OK) switch (ngx_event_connect_peer(&context->peer_connection)) {
+        case NGX_ERROR: case NGX_BUSY: case NGX_DECLINED: {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: Unable to connect to LDAP server \"%V\"", context->peer_connection.name);
+            return NGX_ERROR;
+        }
+    }
+    context->peer_connection.connection->log = r->connection->log;
+    context->peer_connection.connection->log_error = r->connection->log_error;
+    context->peer_connection.connection->read->handler = ngx_http_auth_basic_ldap_read_handler;
+    context->peer_connection.connection->write->handler = ngx_http_auth_basic_ldap_write_handler;
+    context->peer_connection.connection->read->log = r->connection->log;
+    context->peer_connection.connection->write->log = r->connection->log;
+    context->peer_connection.connection->data = r;
+    if (!context->ldap || ngx_http_auth_basic_ldap_sasl_bind(r) == NGX_OK) return NGX_OK;
+    ngx_http_auth_basic_ldap_close(context->peer_connection.connection, context->ldap);
+    context->peer_connection.connection = NULL;
+    context->ldap = NULL;
+    return NGX_ERROR;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_service_search(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_service_t *service = context->service;
+    if (!service->bound) { ngx_queue_insert_tail(&service->waiting, &context->queue); context->waiting = 1; return NGX_OK; }
+    int rc = ldap_search_ext(service->ldap, context->lud->lud_dn, context->lud->lud_scope, context->lud->lud_filter, context->lud->lud_attrs, 0, NULL, NULL, NULL, 0, &context->msgid);
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_search_ext failed: %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_service_close; }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: msgid = %i", context->msgid);
+    context->node.key = (ngx_rbtree_key_t)context->msgid;
+    ngx_rbtree_insert(&service->rbtree, &context->node);
+    context->phase = ngx_current_msec;
+    ngx_add_timer(&context->event, location_conf->search_timeout);
+    return NGX_OK;
+ngx_http_auth_basic_ldap_service_close:
+    context->service = NULL;
+    service->requests--;
+    service->peer_connection.connection->close = 1;
+    ngx_post_event(service->peer_connection.connection->read, &ngx_posted_events);
+    return NGX_ERROR;
+}
+
+static void ngx_http_auth_basic_ldap_service_close(ngx_http_auth_basic_ldap_service_t *service) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "%s", __func__);
+    ngx_queue_remove(&service->queue);
+    while (service->requests) {
+        ngx_http_auth_basic_ldap_context_t *context;
+        if (!ngx_queue_empty(&service->waiting)) context = ngx_queue_data(ngx_queue_head(&service->waiting), ngx_http_auth_basic_ldap_context_t, queue);
+        else context = (ngx_http_auth_basic_ldap_context_t *)((u_char *)ngx_rbtree_min(service->rbtree.root, &service->sentinel) - offsetof(ngx_http_auth_basic_ldap_context_t, node));
+        ngx_http_request_t *r = context->request;
+        ngx_http_auth_basic_ldap_retry(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        if (context->rc != NGX_AGAIN) ngx_http_auth_basic_ldap_wake(r);
+    }
+    ngx_http_auth_basic_ldap_close(service->peer_connection.connection, service->ldap);
+    ngx_free(service);
+}
+
+static void ngx_http_auth_basic_ldap_service_result(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_service_t *service = context->service;
+    char *errmsg = NULL;
+    int errcode;
+    int rc;
+    switch ((rc = ldap_msgtype(context->result))) {
+        case LDAP_RES_SEARCH_ENTRY: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: LDAP_RES_SEARCH_ENTRY"); ngx_http_auth_basic_ldap_message(context, rc, LDAP_SUCCESS); ngx_http_auth_basic_ldap_search_entry(r, service->ldap); if (context->rc != NGX_AGAIN) { (void) ldap_abandon_ext(service->ldap, context->msgid, NULL, NULL); ngx_http_auth_basic_ldap_service_detach(r); } return;
+        case LDAP_RES_SEARCH_REFERENCE: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: LDAP_RES_SEARCH_REFERENCE"); ngx_http_auth_basic_ldap_message(context, rc, LDAP_SUCCESS); return;
+        case LDAP_RES_SEARCH_RESULT: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: LDAP_RES_SEARCH_RESULT"); break;
+        default: ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: unknown ldap_msgtype %d", rc); return;
+    }
+    ngx_http_auth_basic_ldap_service_detach(r);
+    if ((rc = ldap_parse_result(service->ldap, context->result, &errcode, NULL, &errmsg, NULL, NULL, 0)) != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_parse_result failed:  %s", ldap_err2string(rc)); context->rc = NGX_HTTP_INTERNAL_SERVER_ERROR; return; }
+    ngx_http_auth_basic_ldap_message(context, LDAP_RES_SEARCH_RESULT, errcode);
+    if (errcode == LDAP_UNAVAILABLE || errcode == LDAP_BUSY) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: %s [%s]", ldap_err2string(errcode), errmsg ? errmsg : "-"); ngx_http_auth_basic_ldap_retry(r, NGX_HTTP_INTERNAL_SERVER_ERROR); }
+    else if (errcode != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: %s [%s]", ldap_err2string(errcode), errmsg ? errmsg : "-"); context->responded = 1; context->rc = ngx_http_auth_basic_ldap_set_realm(r); }
+    else if (!context->dn.data) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: user \"%V\" was not found", &r->headers_in.user); context->responded = 1; context->cacheable = 1; context->rc = ngx_http_auth_basic_ldap_set_realm(r); }
+    else if (ngx_http_auth_basic_ldap_connect(r) != NGX_OK) ngx_http_auth_basic_ldap_retry(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    if (errmsg) ldap_memfree(errmsg);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_service_bind(ngx_http_auth_basic_ldap_service_t *service) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "%s", __func__);
+    struct berval cred = {service->password.len, (char *)service->password.data};
+    int rc = ldap_sasl_bind(service->ldap, (const char *)service->bind.data, LDAP_SASL_SIMPLE, &cred, NULL, NULL, &service->msgid);
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: ldap_sasl_bind failed: %s", ldap_err2string(rc)); return NGX_ERROR; }
+    return NGX_OK;
+}
+
+#if (NGX_SSL)
+static void ngx_http_auth_basic_ldap_service_ssl_save_session(ngx_connection_t *c) {
+    ngx_http_auth_basic_ldap_service_t *service = c->data;
+    ngx_http_auth_basic_ldap_ssl_session_save(service->location_conf->servers->data, c);
+}
+
+static void ngx_http_auth_basic_ldap_service_ssl_handshaked(ngx_connection_t *c) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_service_t *service = c->data;
+    if (ngx_http_auth_basic_ldap_ssl_done(c, service->location_conf, &service->ssl_name, service->ldap) != NGX_OK) goto ngx_http_auth_basic_ldap_service_close;
+    c->read->handler = ngx_http_auth_basic_ldap_service_read_handler;
+    c->write->handler = ngx_http_auth_basic_ldap_service_write_handler;
+    if (ngx_http_auth_basic_ldap_service_bind(service) != NGX_OK) goto ngx_http_auth_basic_ldap_service_close;
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK || ngx_handle_write_event(c->write, 0) != NGX_OK) goto ngx_http_auth_basic_ldap_service_close;
+    return;
+ngx_http_auth_basic_ldap_service_close:
+    ngx_http_auth_basic_ldap_service_close(service);
+}
+
+static void ngx_http_auth_basic_ldap_service_ssl_handshake(ngx_http_auth_basic_ldap_service_t *service) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "%s", __func__);
+    ngx_connection_t *c = service->peer_connection.connection;
+    if (ngx_http_auth_basic_ldap_ssl_connection(c, service->location_conf, service->ssl, &service->ssl_name, ngx_http_auth_basic_ldap_service_ssl_save_session) != NGX_OK) { ngx_http_auth_basic_ldap_service_close(service); return; }
+    if (ngx_ssl_handshake(c) == NGX_AGAIN) { c->ssl->handler = ngx_http_auth_basic_ldap_service_ssl_handshaked; return; }
+    ngx_http_auth_basic_ldap_service_ssl_handshaked(c);
+}
+#endif
+
+static void ngx_http_auth_basic_ldap_service_read_handler(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__);
+    ngx_connection_t *c = ev->data;
+    ngx_http_auth_basic_ldap_service_t *service = c->data;
+    if (c->close) goto ngx_http_auth_basic_ldap_service_close;
+    if (ev->timedout) { ngx_log_error(NGX_LOG_ERR, ev->log, NGX_ETIMEDOUT, "ldap: service bind \"%V\" to LDAP server \"%V\" timed out", &service->bind, &service->name); goto ngx_http_auth_basic_ldap_service_close; }
+    if (!service->ldap) return;
+    struct timeval timeout = {0, 0};
+    for (;;) {
+        LDAPMessage *result = NULL;
+        int rc = ldap_result(service->ldap, LDAP_RES_ANY, LDAP_MSG_ONE, &timeout, &result);
+        if (!rc) break;
+        if (rc < 0) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "ldap: ldap_result failed: %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_service_close; }
+        int msgid = ldap_msgid(result);
+        if (!service->bound && msgid == service->msgid) {
+            int errcode;
+            char *errmsg = NULL;
+            if ((rc = ldap_parse_result(service->ldap, result, &errcode, NULL, &errmsg, NULL, NULL, 1)) != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "ldap: ldap_parse_result failed:  %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_service_close; }
+            if (errcode != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "ldap: service bind \"%V\": %s [%s]", &service->bind, ldap_err2string(errcode), errmsg ? errmsg : "-"); if (errmsg) ldap_memfree(errmsg); goto ngx_http_auth_basic_ldap_service_close; }
+            if (errmsg) ldap_memfree(errmsg);
+#if (NGX_SSL)
+            if (service->starttls && !c->ssl) { ngx_http_auth_basic_ldap_service_ssl_handshake(service); return; }
+#endif
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "ldap: service bound \"%V\"", &service->bind);
+            if (c->read->timer_set) ngx_del_timer(c->read);
+            service->bound = 1;
+            while (!ngx_queue_empty(&service->waiting)) {
+                ngx_http_auth_basic_ldap_context_t *context = ngx_queue_data(ngx_queue_head(&service->waiting), ngx_http_auth_basic_ldap_context_t, queue);
+                ngx_queue_remove(&context->queue);
+                context->waiting = 0;
+                ngx_http_request_t *r = context->request;
+                if (ngx_http_auth_basic_ldap_service_search(r) != NGX_OK) ngx_http_auth_basic_ldap_retry(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+                if (context->rc != NGX_AGAIN) ngx_http_auth_basic_ldap_wake(r);
+            }
+            continue;
+        }
+        ngx_rbtree_node_t *node = service->rbtree.root;
+        while (node != &service->sentinel && node->key != (ngx_rbtree_key_t)msgid) node = (ngx_rbtree_key_t)msgid < node->key ? node->left : node->right;
+        if (node == &service->sentinel) { ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "ldap: skip msgid = %i", msgid); ldap_msgfree(result); continue; }
+        ngx_http_auth_basic_ldap_context_t *context = (ngx_http_auth_basic_ldap_context_t *)((u_char *)node - offsetof(ngx_http_auth_basic_ldap_context_t, node));
+        ngx_http_request_t *r = context->request;
+        if (context->result) ldap_msgfree(context->result);
+        context->result = result;
+        ngx_http_auth_basic_ldap_service_result(r);
+        if (context->rc != NGX_AGAIN) ngx_http_auth_basic_ldap_wake(r);
+    }
+    if (!service->requests && (ngx_terminate || ngx_exiting)) goto ngx_http_auth_basic_ldap_service_close;
+    if (ngx_handle_read_event(ev, 0) != NGX_OK) goto ngx_http_auth_basic_ldap_service_close;
+    return;
+ngx_http_auth_basic_ldap_service_close:
+    ngx_http_auth_basic_ldap_service_close(service);
+}
+
+static void ngx_http_auth_basic_ldap_service_write_handler(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__);
+    ngx_connection_t *c = ev->data;
+    ngx_http_auth_basic_ldap_service_t *service = c->data;
+    if (ev->timedout) { ngx_log_error(NGX_LOG_ERR, ev->log, NGX_ETIMEDOUT, "ldap: service connection to LDAP server \"%V\" timed out", &service->name); goto ngx_http_auth_basic_ldap_service_close; }
+    if (service->ldap) {
+        if (ngx_handle_write_event(ev, 0) != NGX_OK) goto ngx_http_auth_basic_ldap_service_close;
+        ngx_http_auth_basic_ldap_service_read_handler(c->read);
+        return;
+    }
+    if (ev->timer_set) ngx_del_timer(ev);
+    int rc = ldap_init_fd(c->fd, LDAP_PROTO_TCP, NULL, &service->ldap);
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "ldap: ldap_init_fd failed: %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_service_close; }
+    ngx_add_timer(c->read, service->bind_timeout);
+#if (NGX_SSL)
+    if (service->starttls) {
+        if ((rc = ldap_extended_operation(service->ldap, LDAP_EXOP_START_TLS, NULL, NULL, NULL, &service->msgid)) != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "ldap: ldap_extended_operation failed: %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_service_close; }
+    } else if (service->ssl) { ngx_http_auth_basic_ldap_service_ssl_handshake(service); return; } else
+#endif
+    if (ngx_http_auth_basic_ldap_service_bind(service) != NGX_OK) goto ngx_http_auth_basic_ldap_service_close;
+    if (ngx_handle_write_event(ev, 0) != NGX_OK) goto ngx_http_auth_basic_ldap_service_close;
+    return;
+ngx_http_auth_basic_ldap_service_close:
+    ngx_http_auth_basic_ldap_service_close(service);
+}
+
+static ngx_http_auth_basic_ldap_service_t *ngx_http_auth_basic_ldap_service_get(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf = ngx_http_get_module_main_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_service_t *service = NULL;
+    ngx_uint_t n = 0;
+    for (ngx_queue_t *q = ngx_queue_head(&main_conf->service); q != ngx_queue_sentinel(&main_conf->service); q = ngx_queue_next(q)) {
+        ngx_http_auth_basic_ldap_service_t *s = ngx_queue_data(q, ngx_http_auth_basic_ldap_service_t, queue);
+        if (s->peer_connection.connection->close) continue;
+        if (ngx_memn2cmp(s->sockaddr, (u_char *)context->peer_connection.sockaddr, s->peer_connection.socklen, context->peer_connection.socklen)) continue;
+        if (s->bind.data != location_conf->service_bind.data || s->password.data != location_conf->service_password.data) continue;
+#if (NGX_SSL)
+        if (s->ssl != context->ssl || s->starttls != context->starttls) continue;
+#endif
+        n++;
+        if (!service || s->requests < service->requests) service = s;
+    }
+    if (service && (!service->requests || n >= main_conf->service_connections)) goto attach;
+    size_t len = sizeof(ngx_http_auth_basic_ldap_service_t) + context->peer_connection.name->len;
+#if (NGX_SSL)
+    ngx_str_t ssl_name = ngx_null_string;
+    if (context->ssl) len += (ssl_name = ngx_http_auth_basic_ldap_ssl_name(location_conf, context->lud)).len + 1;
+#endif
+    if (!(service = ngx_calloc(len, r->connection->log))) return NULL;
+    service->main_conf = main_conf;
+    service->location_conf = location_conf;
+    ngx_queue_init(&service->waiting);
+    ngx_rbtree_init(&service->rbtree, &service->sentinel, ngx_rbtree_insert_value);
+    service->bind = location_conf->service_bind;
+    service->password = location_conf->service_password;
+    service->bind_timeout = location_conf->bind_timeout;
+    service->name.len = context->peer_connection.name->len;
+    service->name.data = (u_char *)(service + 1);
+    ngx_memcpy(service->name.data, context->peer_connection.name->data, service->name.len);
+#if (NGX_SSL)
+    service->ssl = context->ssl;
+    service->starttls = context->starttls;
+    if (context->ssl) {
+        service->ssl_name.len = ssl_name.len;
+        service->ssl_name.data = service->name.data + service->name.len;
+        (void) ngx_cpystrn(service->ssl_name.data, ssl_name.data, ssl_name.len + 1);
+    }
+#endif
+    ngx_memcpy(service->sockaddr, context->peer_connection.sockaddr, context->peer_connection.socklen);
+    service->peer_connection.sockaddr = (struct sockaddr *)service->sockaddr;
+    service->peer_connection.socklen = context->peer_connection.socklen;
+    service->peer_connection.name = &service->name;
+    service->peer_connection.get = ngx_event_get_peer;
+    service->peer_connection.log = ngx_cycle->log;
+    service->peer_connection.log_error = NGX_ERROR_ERR;
+    switch (ngx_event_connect_peer(&service->peer_connection)) {
+        case NGX_ERROR: case NGX_BUSY: case NGX_DECLINED: ngx_free(service); return NULL;
+    }
+    ngx_connection_t *c = service->peer_connection.connection;
+    c->data = service;
+    c->read->handler = ngx_http_auth_basic_ldap_service_read_handler;
+    c->write->handler = ngx_http_auth_basic_ldap_service_write_handler;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+    ngx_add_timer(c->write, location_conf->connect_timeout);
+    ngx_queue_insert_tail(&main_conf->service, &service->queue);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: new service connection %p", c);
+attach:
+    service->requests++;
+    service->peer_connection.connection->idle = 0;
+    context->service = service;
+    return service;
+}
+
+static void ngx_http_auth_basic_ldap_sync_evict(ngx_http_auth_basic_ldap_sync_t *sync, ngx_array_t *hashes, ngx_array_t *groups) {
+    ngx_http_auth_basic_ldap_cache_t *cache = sync->cache->data;
+    ngx_uint_t n = ngx_http_auth_basic_ldap_cache_evict(cache, hashes, groups);
+    if (!hashes) { ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0, "ldap: cache sync with \"%V\" evicted all %ui entries", sync->peer_connection.name, n); return; }
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "ldap: cache sync evicted %ui entries of %ui dns and %ui groups", n, hashes->nelts, groups->nelts);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_sync_cookie(ngx_http_auth_basic_ldap_sync_t *sync, struct berval *cookie) {
+    u_char *data = NULL;
+    if (cookie->bv_len && !(data = ngx_alloc(cookie->bv_len, ngx_cycle->log))) return NGX_ERROR;
+    if (sync->cookie.bv_val) ngx_free(sync->cookie.bv_val);
+    if (data) ngx_memcpy(data, cookie->bv_val, cookie->bv_len);
+    sync->cookie.bv_val = (char *)data;
+    sync->cookie.bv_len = cookie->bv_len;
+    return NGX_OK;
+}
+
+static ngx_uint_t ngx_http_auth_basic_ldap_sync_member(struct berval *attr) {
+    static ngx_str_t members[] = { ngx_string("member"), ngx_string("uniqueMember") };
+    for (ngx_uint_t i = 0; i < sizeof(members) / sizeof(members[0]); i++) {
+        if (attr->bv_len < members[i].len || ngx_strncasecmp((u_char *)attr->bv_val, members[i].data, members[i].len)) continue;
+        if (attr->bv_len == members[i].len || attr->bv_val[members[i].len] == ';') return 1;
+    }
+    return 0;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_sync_entry(ngx_http_auth_basic_ldap_sync_t *sync, LDAPMessage *entry) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "%s", __func__);
+    LDAPControl **ctrls = NULL;
+    BerElement *ber = NULL;
+    struct berval *vals = NULL;
+    ngx_uint_t flush = 0;
+    ngx_int_t rv = NGX_ERROR;
+    ngx_pool_t *pool = ngx_create_pool(ngx_pagesize, ngx_cycle->log);
+    if (!pool) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "!ngx_create_pool"); return NGX_ERROR; }
+    ngx_array_t hashes, groups;
+    if (ngx_array_init(&hashes, pool, 4, sizeof(uint32_t)) != NGX_OK || ngx_array_init(&groups, pool, 2, sizeof(uint32_t)) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ngx_array_init != NGX_OK"); goto free; }
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_auth_basic_ldap_module);
+    uintptr_t id;
+    int rc = ldap_get_entry_controls(sync->ldap, entry, &ctrls);
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: ldap_get_entry_controls failed: %s", ldap_err2string(rc)); goto free; }
+    ber_int_t state = LDAP_SYNC_MODIFY;
+    LDAPControl *ctrl;
+    if (sync->mode == NGX_HTTP_AUTH_BASIC_LDAP_SYNC_SYNCREPL) {
+        if (!(ctrl = ldap_control_find(LDAP_CONTROL_SYNC_STATE, ctrls, NULL))) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: no sync state control in entry"); goto free; }
+        struct berval uuid, cookie = {0, NULL};
+        ber_len_t len;
+        BerElement *cber = ber_init(&ctrl->ldctl_value);
+        if (!cber) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: ber_init failed"); goto free; }
+        if (ber_scanf(cber, "{em", &state, &uuid) == LBER_ERROR || (ber_peek_tag(cber, &len) == LDAP_TAG_SYNC_COOKIE && ber_scanf(cber, "m", &cookie) == LBER_ERROR)) { ber_free(cber, 1); ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: invalid sync state control"); goto free; }
+        rc = cookie.bv_len ? ngx_http_auth_basic_ldap_sync_cookie(sync, &cookie) : NGX_OK;
+        ber_free(cber, 1);
+        if (rc != NGX_OK) goto free;
+    }
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "ldap: sync state = %d, refreshed = %d", state, sync->refreshed);
+    if (!sync->refreshed || state == LDAP_SYNC_PRESENT) { rv = NGX_OK; goto free; }
+    struct berval bv;
+    if ((rc = ldap_get_dn_ber(sync->ldap, entry, &ber, &bv)) != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: ldap_get_dn_ber failed: %s", ldap_err2string(rc)); goto free; }
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "ldap: sync dn = %*s", (size_t)bv.bv_len, bv.bv_val);
+    uint32_t *hash = ngx_array_push(&hashes);
+    if (!hash) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "!ngx_array_push"); goto free; }
+    *hash = ngx_http_auth_basic_ldap_dn_hash((u_char *)bv.bv_val, bv.bv_len);
+    if ((id = ngx_http_auth_basic_ldap_group_id(main_conf, (u_char *)bv.bv_val, bv.bv_len))) {
+        if (!(hash = ngx_array_push(&groups))) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "!ngx_array_push"); goto free; }
+        *hash = (uint32_t)(id - 1);
+    }
+    if (sync->mode == NGX_HTTP_AUTH_BASIC_LDAP_SYNC_PSEARCH && (ctrl = ldap_control_find(LDAP_CONTROL_PERSIST_ENTRY_CHANGE_NOTICE, ctrls, NULL))) {
+        struct berval previous;
+        ber_int_t type;
+        ber_len_t len;
+        BerElement *cber = ber_init(&ctrl->ldctl_value);
+        if (cber && ber_scanf(cber, "{e", &type) != LBER_ERROR && ber_peek_tag(cber, &len) == LBER_OCTETSTRING && ber_scanf(cber, "m", &previous) != LBER_ERROR) {
+            if (!(hash = ngx_array_push(&hashes))) { ber_free(cber, 1); ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "!ngx_array_push"); goto free; }
+            *hash = ngx_http_auth_basic_ldap_dn_hash((u_char *)previous.bv_val, previous.bv_len);
+            if ((id = ngx_http_auth_basic_ldap_group_id(main_conf, (u_char *)previous.bv_val, previous.bv_len))) {
+                if (!(hash = ngx_array_push(&groups))) { ber_free(cber, 1); ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "!ngx_array_push"); goto free; }
+                *hash = (uint32_t)(id - 1);
+            }
+        }
+        if (cber) ber_free(cber, 1);
+    }
+    for (rc = ldap_get_attribute_ber(sync->ldap, entry, ber, &bv, &vals); rc == LDAP_SUCCESS && bv.bv_val; rc = ldap_get_attribute_ber(sync->ldap, entry, ber, &bv, &vals)) {
+        if (bv.bv_len == sizeof("isDeleted") - 1 && !ngx_strncasecmp((u_char *)bv.bv_val, (u_char *)"isDeleted", sizeof("isDeleted") - 1)) flush = 1;
+        else if (vals && ngx_http_auth_basic_ldap_sync_member(&bv)) for (struct berval *val = vals; val->bv_val; val++) {
+            if (!(hash = ngx_array_push(&hashes))) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "!ngx_array_push"); goto free; }
+            *hash = ngx_http_auth_basic_ldap_dn_hash((u_char *)val->bv_val, val->bv_len);
+        }
+        if (vals) { ber_memfree(vals); vals = NULL; }
+    }
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: ldap_get_attribute_ber failed: %s", ldap_err2string(rc)); goto free; }
+    ngx_http_auth_basic_ldap_sync_evict(sync, flush ? NULL : &hashes, &groups);
+    rv = NGX_OK;
+free:
+    if (vals) ber_memfree(vals);
     if (ber) ber_free(ber, 0);
-    return;
-rc_NGX_HTTP_INTERNAL_SERVER_ERROR:
-    context->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
-    goto free;
-rc_NGX_ERROR:
-    context->rc = NGX_ERROR;
+    if (ctrls) ldap_controls_free(ctrls);
+    ngx_destroy_pool(pool);
+    return rv;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_sync_info(ngx_http_auth_basic_ldap_sync_t *sync, LDAPMessage *result) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "%s", __func__);
+    char *oid = NULL;
+    struct berval *data = NULL;
+    BerElement *ber = NULL;
+    ngx_int_t rv = NGX_ERROR;
+    int rc = ldap_parse_intermediate(sync->ldap, result, &oid, &data, NULL, 0);
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: ldap_parse_intermediate failed: %s", ldap_err2string(rc)); goto free; }
+    if (!oid || ngx_strcmp(oid, LDAP_SYNC_INFO) || !data) { rv = NGX_OK; goto free; }
+    if (!(ber = ber_init(data))) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: ber_init failed"); goto free; }
+    struct berval cookie = {0, NULL};
+    ber_int_t done = 1, deletes = 0;
+    ber_len_t len;
+    ngx_uint_t flush = 0;
+    ber_tag_t tag = ber_peek_tag(ber, &len);
+    switch (tag) {
+        case LDAP_TAG_SYNC_NEW_COOKIE: if (ber_scanf(ber, "m", &cookie) == LBER_ERROR) goto invalid; break;
+        case LDAP_TAG_SYNC_REFRESH_DELETE: case LDAP_TAG_SYNC_REFRESH_PRESENT: {
+            if (ber_scanf(ber, "{") == LBER_ERROR) goto invalid;
+            if (ber_peek_tag(ber, &len) == LDAP_TAG_SYNC_COOKIE && ber_scanf(ber, "m", &cookie) == LBER_ERROR) goto invalid;
+            if (ber_peek_tag(ber, &len) == LDAP_TAG_REFRESHDONE && ber_scanf(ber, "b", &done) == LBER_ERROR) goto invalid;
+            if (tag == LDAP_TAG_SYNC_REFRESH_PRESENT && sync->refreshed) flush = 1;
+            if (done) sync->refreshed = 1;
+        } break;
+        case LDAP_TAG_SYNC_ID_SET: {
+            if (ber_scanf(ber, "{") == LBER_ERROR) goto invalid;
+            if (ber_peek_tag(ber, &len) == LDAP_TAG_SYNC_COOKIE && ber_scanf(ber, "m", &cookie) == LBER_ERROR) goto invalid;
+            if (ber_peek_tag(ber, &len) == LDAP_TAG_REFRESHDELETES && ber_scanf(ber, "b", &deletes) == LBER_ERROR) goto invalid;
+            if (deletes && sync->refreshed) flush = 1;
+        } break;
+        default: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "ldap: skip sync info tag = %ui", (ngx_uint_t)tag); break;
+    }
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "ldap: sync info cookie len = %ui, refreshed = %d, flush = %ui", (ngx_uint_t)cookie.bv_len, sync->refreshed, flush);
+    if (cookie.bv_len && ngx_http_auth_basic_ldap_sync_cookie(sync, &cookie) != NGX_OK) goto free;
+    if (flush) ngx_http_auth_basic_ldap_sync_evict(sync, NULL, NULL);
+    rv = NGX_OK;
+free:
+    if (ber) ber_free(ber, 1);
+    if (data) ber_bvfree(data);
+    if (oid) ldap_memfree(oid);
+    return rv;
+invalid:
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: invalid sync info message");
     goto free;
 }
 
-static void ngx_http_auth_basic_ldap_read_handler(ngx_event_t *ev) {
-    ngx_connection_t *c = ev->data;
-    ngx_http_request_t *r = c->data;
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
-    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
-    if (!context->ldap) return;
-    if (context->rc != NGX_AGAIN) return;
+static ngx_int_t ngx_http_auth_basic_ldap_sync_search(ngx_http_auth_basic_ldap_sync_t *sync) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "%s", __func__);
+    if (!sync->cookie.bv_len) { sync->refreshed = 0; ngx_http_auth_basic_ldap_sync_evict(sync, NULL, NULL); }
+    if (sync->mode != NGX_HTTP_AUTH_BASIC_LDAP_SYNC_DIRSYNC) sync->refreshed = sync->mode == NGX_HTTP_AUTH_BASIC_LDAP_SYNC_PSEARCH || sync->cookie.bv_len;
+    BerElement *ber = ber_alloc_t(LBER_USE_DER);
+    if (!ber) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: ber_alloc_t failed"); return NGX_ERROR; }
+    const char *oid;
+    int rc;
+    switch (sync->mode) {
+        case NGX_HTTP_AUTH_BASIC_LDAP_SYNC_SYNCREPL: oid = LDAP_CONTROL_SYNC; rc = sync->cookie.bv_len ? ber_printf(ber, "{eO}", (ber_int_t)LDAP_SYNC_REFRESH_AND_PERSIST, &sync->cookie) : ber_printf(ber, "{e}", (ber_int_t)LDAP_SYNC_REFRESH_AND_PERSIST); break;
+        case NGX_HTTP_AUTH_BASIC_LDAP_SYNC_PSEARCH: oid = LDAP_CONTROL_PERSIST_REQUEST; rc = ber_printf(ber, "{ibb}", (ber_int_t)NGX_HTTP_AUTH_BASIC_LDAP_PSEARCH_CHANGES, (ber_int_t)1, (ber_int_t)1); break;
+        default: oid = NGX_HTTP_AUTH_BASIC_LDAP_DIRSYNC; rc = ber_printf(ber, "{iiO}", NGX_HTTP_AUTH_BASIC_LDAP_DIRSYNC_INCREMENTAL_VALUES, (ber_int_t)NGX_HTTP_AUTH_BASIC_LDAP_DIRSYNC_MAX_BYTES, &sync->cookie); break;
+    }
+    if (rc == -1) { ber_free(ber, 1); ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: ber_printf failed"); return NGX_ERROR; }
+    LDAPControl *ctrl = NULL;
+    rc = ldap_create_control(oid, ber, 1, &ctrl);
+    ber_free(ber, 1);
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: ldap_create_control failed: %s", ldap_err2string(rc)); return NGX_ERROR; }
+    LDAPControl *ctrls[] = {ctrl, NULL};
+    rc = ldap_search_ext(sync->ldap, sync->lud->lud_dn, sync->lud->lud_scope, sync->lud->lud_filter, sync->lud->lud_attrs, 0, ctrls, NULL, NULL, 0, &sync->msgid);
+    ldap_control_free(ctrl);
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: ldap_search_ext failed: %s", ldap_err2string(rc)); return NGX_ERROR; }
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_sync_result(ngx_http_auth_basic_ldap_sync_t *sync, LDAPMessage *result) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "%s", __func__);
+    LDAPControl **ctrls = NULL;
     char *errmsg = NULL;
-    struct timeval timeout = {0, 0};
-    int rc = ldap_result(context->ldap, context->msgid, 0, &timeout, &context->result);
-    if (!rc) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: ldap_result = 0"); goto ngx_http_core_run_phases; }
-    if (rc < 0) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_result failed: %s", ldap_err2string(rc)); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
     int errcode;
-    switch ((rc = ldap_parse_result(context->ldap, context->result, &errcode, NULL, &errmsg, NULL, NULL, 0))) {
-        case LDAP_SUCCESS: case LDAP_NO_RESULTS_RETURNED: break;
-        default: ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_parse_result failed:  %s", ldap_err2string(rc)); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR;
+    ngx_int_t rv = NGX_ERROR;
+    int rc;
+    switch ((rc = ldap_msgtype(result))) {
+        case LDAP_RES_SEARCH_ENTRY: rv = ngx_http_auth_basic_ldap_sync_entry(sync, result); ldap_msgfree(result); return rv;
+        case LDAP_RES_INTERMEDIATE: rv = ngx_http_auth_basic_ldap_sync_info(sync, result); ldap_msgfree(result); return rv;
+        case LDAP_RES_SEARCH_RESULT: break;
+        default: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "ldap: skip ldap_msgtype %d", rc); ldap_msgfree(result); return NGX_OK;
     }
-    if (errcode != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: %s [%s]", ldap_err2string(errcode), errmsg ? errmsg : "-"); goto ngx_http_auth_basic_ldap_set_realm; }
-    switch ((rc = ldap_msgtype(context->result))) {
-        case LDAP_RES_BIND: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: LDAP_RES_BIND"); ngx_http_auth_basic_ldap_bind(r); break;
-        case LDAP_RES_SEARCH_ENTRY: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: LDAP_RES_SEARCH_ENTRY"); ngx_http_auth_basic_ldap_search_entry(r); break;
-        case LDAP_RES_SEARCH_REFERENCE: ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: LDAP_RES_SEARCH_REFERENCE"); goto ngx_http_auth_basic_ldap_set_realm;
-        case LDAP_RES_SEARCH_RESULT: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: LDAP_RES_SEARCH_RESULT"); goto ngx_http_auth_basic_ldap_set_realm;
-        case LDAP_RES_MODIFY: ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: LDAP_RES_MODIFY"); goto ngx_http_auth_basic_ldap_set_realm;
-        case LDAP_RES_ADD: ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: LDAP_RES_ADD"); goto ngx_http_auth_basic_ldap_set_realm;
-        case LDAP_RES_DELETE: ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: LDAP_RES_DELETE"); goto ngx_http_auth_basic_ldap_set_realm;
-        case LDAP_RES_MODDN: ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: LDAP_RES_MODDN"); goto ngx_http_auth_basic_ldap_set_realm;
-        case LDAP_RES_COMPARE: ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: LDAP_RES_COMPARE"); goto ngx_http_auth_basic_ldap_set_realm;
-        case LDAP_RES_EXTENDED: ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: LDAP_RES_EXTENDED"); goto ngx_http_auth_basic_ldap_set_realm;
-        case LDAP_RES_INTERMEDIATE: ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: LDAP_RES_INTERMEDIATE"); goto ngx_http_auth_basic_ldap_set_realm;
-        default: ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: unknown ldap_msgtype %d", rc); goto ngx_http_auth_basic_ldap_set_realm;
+    if ((rc = ldap_parse_result(sync->ldap, result, &errcode, NULL, &errmsg, NULL, &ctrls, 1)) != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: ldap_parse_result failed:  %s", ldap_err2string(rc)); return NGX_ERROR; }
+    if (sync->mode == NGX_HTTP_AUTH_BASIC_LDAP_SYNC_SYNCREPL && errcode == LDAP_SYNC_REFRESH_REQUIRED) {
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0, "ldap: cache sync with \"%V\" requires refresh", sync->peer_connection.name);
+        struct berval cookie = {0, NULL};
+        if (ngx_http_auth_basic_ldap_sync_cookie(sync, &cookie) == NGX_OK) rv = ngx_http_auth_basic_ldap_sync_search(sync);
+        goto free;
     }
-ngx_http_core_run_phases:
-    if (ngx_handle_read_event(ev, 0) != NGX_OK) context->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (errcode != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: cache sync with \"%V\": %s [%s]", sync->peer_connection.name, ldap_err2string(errcode), errmsg ? errmsg : "-"); goto free; }
+    if (sync->mode != NGX_HTTP_AUTH_BASIC_LDAP_SYNC_DIRSYNC) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: cache sync with \"%V\" finished by LDAP server", sync->peer_connection.name); goto free; }
+    LDAPControl *ctrl = ldap_control_find(NGX_HTTP_AUTH_BASIC_LDAP_DIRSYNC, ctrls, NULL);
+    if (!ctrl) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: no dirsync control in result"); goto free; }
+    BerElement *ber = ber_init(&ctrl->ldctl_value);
+    if (!ber) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: ber_init failed"); goto free; }
+    ber_int_t more, unused;
+    struct berval cookie;
+    if (ber_scanf(ber, "{iim}", &more, &unused, &cookie) == LBER_ERROR) { ber_free(ber, 1); ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: invalid dirsync control"); goto free; }
+    rc = ngx_http_auth_basic_ldap_sync_cookie(sync, &cookie);
+    ber_free(ber, 1);
+    if (rc != NGX_OK) goto free;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "ldap: dirsync more = %d, cookie len = %ui", more, (ngx_uint_t)sync->cookie.bv_len);
+    if (more) { rv = ngx_http_auth_basic_ldap_sync_search(sync); goto free; }
+    sync->refreshed = 1;
+    rv = NGX_DONE;
+free:
     if (errmsg) ldap_memfree(errmsg);
-    if (context->rc != NGX_AGAIN) { ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: Waking authentication request \"%V\"", &r->request_line); ngx_http_core_run_phases(r); }
+    if (ctrls) ldap_controls_free(ctrls);
+    return rv;
+}
+
+static void ngx_http_auth_basic_ldap_sync_close(ngx_http_auth_basic_ldap_sync_t *sync) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_close(sync->peer_connection.connection, sync->ldap);
+    sync->peer_connection.connection = NULL;
+    sync->ldap = NULL;
+    sync->bound = 0;
+    if (ngx_terminate || ngx_exiting) return;
+    ngx_add_timer(&sync->event, sync->interval);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_sync_bind(ngx_http_auth_basic_ldap_sync_t *sync) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = sync->location_conf;
+    struct berval cred = {location_conf->service_password.len, (char *)location_conf->service_password.data};
+    int rc = ldap_sasl_bind(sync->ldap, (const char *)location_conf->service_bind.data, LDAP_SASL_SIMPLE, &cred, NULL, NULL, &sync->msgid);
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ldap: ldap_sasl_bind failed: %s", ldap_err2string(rc)); return NGX_ERROR; }
+    return NGX_OK;
+}
+
+#if (NGX_SSL)
+static void ngx_http_auth_basic_ldap_sync_ssl_save_session(ngx_connection_t *c) {
+    ngx_http_auth_basic_ldap_sync_t *sync = c->data;
+    ngx_http_auth_basic_ldap_ssl_session_save(sync->location_conf->servers->data, c);
+}
+
+static void ngx_http_auth_basic_ldap_sync_ssl_handshaked(ngx_connection_t *c) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_sync_t *sync = c->data;
+    if (ngx_http_auth_basic_ldap_ssl_done(c, sync->location_conf, &sync->ssl_name, sync->ldap) != NGX_OK) goto ngx_http_auth_basic_ldap_sync_close;
+    c->read->handler = ngx_http_auth_basic_ldap_sync_read_handler;
+    c->write->handler = ngx_http_auth_basic_ldap_sync_write_handler;
+    if (ngx_http_auth_basic_ldap_sync_bind(sync) != NGX_OK) goto ngx_http_auth_basic_ldap_sync_close;
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK || ngx_handle_write_event(c->write, 0) != NGX_OK) goto ngx_http_auth_basic_ldap_sync_close;
     return;
-ngx_http_auth_basic_ldap_set_realm:
-    context->rc = ngx_http_auth_basic_ldap_set_realm(r);
-    goto ngx_http_core_run_phases;
-rc_NGX_HTTP_INTERNAL_SERVER_ERROR:
-    context->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
-    goto ngx_http_core_run_phases;
+ngx_http_auth_basic_ldap_sync_close:
+    ngx_http_auth_basic_ldap_sync_close(sync);
 }
 
-static void ngx_http_auth_basic_ldap_write_handler(ngx_event_t *ev) {
+static void ngx_http_auth_basic_ldap_sync_ssl_handshake(ngx_http_auth_basic_ldap_sync_t *sync) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "%s", __func__);
+    ngx_connection_t *c = sync->peer_connection.connection;
+    if (ngx_http_auth_basic_ldap_ssl_connection(c, sync->location_conf, sync->ssl, &sync->ssl_name, ngx_http_auth_basic_ldap_sync_ssl_save_session) != NGX_OK) { ngx_http_auth_basic_ldap_sync_close(sync); return; }
+    if (ngx_ssl_handshake(c) == NGX_AGAIN) { c->ssl->handler = ngx_http_auth_basic_ldap_sync_ssl_handshaked; return; }
+    ngx_http_auth_basic_ldap_sync_ssl_handshaked(c);
+}
+#endif
+
+static void ngx_http_auth_basic_ldap_sync_read_handler(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__);
     ngx_connection_t *c = ev->data;
-    ngx_http_request_t *r = c->data;
+    ngx_http_auth_basic_ldap_sync_t *sync = c->data;
+    if (c->close) goto ngx_http_auth_basic_ldap_sync_close;
+    if (ev->timedout) { ngx_log_error(NGX_LOG_ERR, ev->log, NGX_ETIMEDOUT, "ldap: cache sync bind to LDAP server \"%V\" timed out", sync->peer_connection.name); goto ngx_http_auth_basic_ldap_sync_close; }
+    if (!sync->ldap) return;
+    struct timeval timeout = {0, 0};
+    for (;;) {
+        LDAPMessage *result = NULL;
+        int rc = ldap_result(sync->ldap, LDAP_RES_ANY, LDAP_MSG_ONE, &timeout, &result);
+        if (!rc) break;
+        if (rc < 0) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "ldap: ldap_result failed: %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_sync_close; }
+        if (ldap_msgid(result) != sync->msgid) { ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "ldap: skip msgid = %i", ldap_msgid(result)); ldap_msgfree(result); continue; }
+        if (sync->bound) switch (ngx_http_auth_basic_ldap_sync_result(sync, result)) {
+            case NGX_OK: continue;
+            case NGX_DONE: ngx_add_timer(&sync->event, sync->interval); continue;
+            default: goto ngx_http_auth_basic_ldap_sync_close;
+        }
+        int errcode;
+        char *errmsg = NULL;
+        if ((rc = ldap_parse_result(sync->ldap, result, &errcode, NULL, &errmsg, NULL, NULL, 1)) != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "ldap: ldap_parse_result failed:  %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_sync_close; }
+        if (errcode != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "ldap: cache sync bind to LDAP server \"%V\": %s [%s]", sync->peer_connection.name, ldap_err2string(errcode), errmsg ? errmsg : "-"); if (errmsg) ldap_memfree(errmsg); goto ngx_http_auth_basic_ldap_sync_close; }
+        if (errmsg) ldap_memfree(errmsg);
+#if (NGX_SSL)
+        if (sync->starttls && !c->ssl) { ngx_http_auth_basic_ldap_sync_ssl_handshake(sync); return; }
+#endif
+        if (c->read->timer_set) ngx_del_timer(c->read);
+        sync->bound = 1;
+        if (ngx_http_auth_basic_ldap_sync_search(sync) != NGX_OK) goto ngx_http_auth_basic_ldap_sync_close;
+    }
+    if (ngx_handle_read_event(ev, 0) != NGX_OK) goto ngx_http_auth_basic_ldap_sync_close;
+    return;
+ngx_http_auth_basic_ldap_sync_close:
+    ngx_http_auth_basic_ldap_sync_close(sync);
+}
+
+static void ngx_http_auth_basic_ldap_sync_write_handler(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__);
+    ngx_connection_t *c = ev->data;
+    ngx_http_auth_basic_ldap_sync_t *sync = c->data;
+    if (ev->timedout) { ngx_log_error(NGX_LOG_ERR, ev->log, NGX_ETIMEDOUT, "ldap: cache sync connection to LDAP server \"%V\" timed out", sync->peer_connection.name); goto ngx_http_auth_basic_ldap_sync_close; }
+    if (sync->ldap) return;
+    if (ev->timer_set) ngx_del_timer(ev);
+    int rc = ldap_init_fd(c->fd, LDAP_PROTO_TCP, NULL, &sync->ldap);
+    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "ldap: ldap_init_fd failed: %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_sync_close; }
+    ngx_add_timer(c->read, sync->location_conf->bind_timeout);
+#if (NGX_SSL)
+    if (sync->starttls) {
+        if ((rc = ldap_extended_operation(sync->ldap, LDAP_EXOP_START_TLS, NULL, NULL, NULL, &sync->msgid)) != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, ev->log, 0, "ldap: ldap_extended_operation failed: %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_sync_close; }
+    } else if (sync->ssl) { ngx_http_auth_basic_ldap_sync_ssl_handshake(sync); return; } else
+#endif
+    if (ngx_http_auth_basic_ldap_sync_bind(sync) != NGX_OK) goto ngx_http_auth_basic_ldap_sync_close;
+    if (ngx_handle_write_event(ev, 0) != NGX_OK) goto ngx_http_auth_basic_ldap_sync_close;
+    return;
+ngx_http_auth_basic_ldap_sync_close:
+    ngx_http_auth_basic_ldap_sync_close(sync);
+}
+
+static void ngx_http_auth_basic_ldap_sync_connect(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_sync_t *sync = ev->data;
+    ngx_addr_t *addr = &sync->addrs[sync->addr++ % sync->naddrs];
+    ngx_memzero(&sync->peer_connection, sizeof(ngx_peer_connection_t));
+    sync->peer_connection.sockaddr = addr->sockaddr;
+    sync->peer_connection.socklen = addr->socklen;
+    sync->peer_connection.name = &addr->name;
+    sync->peer_connection.get = ngx_event_get_peer;
+    sync->peer_connection.log = ngx_cycle->log;
+    sync->peer_connection.log_error = NGX_ERROR_ERR;
+    switch (ngx_event_connect_peer(&sync->peer_connection)) {
+        case NGX_ERROR: case NGX_BUSY: case NGX_DECLINED: {
+            ngx_log_error(NGX_LOG_ERR, ev->log, 0, "ldap: Unable to connect to LDAP server \"%V\"", &addr->name);
+            sync->peer_connection.connection = NULL;
+            ngx_add_timer(ev, sync->interval);
+            return;
+        }
+    }
+    ngx_connection_t *c = sync->peer_connection.connection;
+    c->data = sync;
+    c->idle = 1;
+    c->read->handler = ngx_http_auth_basic_ldap_sync_read_handler;
+    c->write->handler = ngx_http_auth_basic_ldap_sync_write_handler;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+    ngx_add_timer(c->write, sync->location_conf->connect_timeout);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "ldap: new cache sync connection %p", c);
+}
+
+static void ngx_http_auth_basic_ldap_sync_handler(ngx_event_t *ev) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_sync_t *sync = ev->data;
+    if (!sync->peer_connection.connection) { ngx_http_auth_basic_ldap_sync_connect(ev); return; }
+    if (sync->bound && ngx_http_auth_basic_ldap_sync_search(sync) != NGX_OK) ngx_http_auth_basic_ldap_sync_close(sync);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_start(ngx_http_request_t *r) {
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
     ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
-    if (context->ldap) return;
+    while (context->tries < (location_conf->tries ? location_conf->tries : context->naddrs)) {
+        if (ngx_http_auth_basic_ldap_servers_get(r) != NGX_OK) break;
+        ngx_addr_t *addr = &context->addrs[context->addr];
+        context->tries++;
+        context->phase = ngx_current_msec;
+        context->peer_connection.sockaddr = addr->sockaddr;
+        context->peer_connection.socklen = addr->socklen;
+        context->peer_connection.name = &addr->name;
+        context->peer_connection.get = ngx_event_get_peer;
+        context->peer_connection.log = r->connection->log;
+        context->peer_connection.log_error = r->connection->log_error;
+        ngx_add_timer(&context->event, location_conf->connect_timeout);
+        if (!location_conf->service_bind.data) { if (ngx_http_auth_basic_ldap_connect(r) == NGX_OK) return NGX_OK; }
+        else if (ngx_http_auth_basic_ldap_service_get(r)) { if (ngx_http_auth_basic_ldap_service_search(r) == NGX_OK) return NGX_OK; }
+        else ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: Unable to connect to LDAP server \"%V\"", &addr->name);
+        ngx_http_auth_basic_ldap_servers_free(context, NGX_ERROR);
+    }
+    if (context->event.timer_set) ngx_del_timer(&context->event);
+    return NGX_ERROR;
+}
+
+static void ngx_http_auth_basic_ldap_timeout_handler(ngx_event_t *ev) {
+    ngx_http_request_t *r = ev->data;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, NGX_ETIMEDOUT, "ldap: LDAP server \"%V\" timed out", context->peer_connection.name);
     if (context->rc != NGX_AGAIN) return;
-    int rc = ldap_init_fd(c->fd, LDAP_PROTO_TCP, NULL, &context->ldap);
-    if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_init_fd failed: %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_set_realm; }
-    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
-    ngx_str_t bind;
-    if (!location_conf->bind) bind.len = r->headers_in.user.len + sizeof("@") - 1 + ngx_strlen(context->lud->lud_dn);
-    else if (ngx_http_complex_value(r, location_conf->bind, &bind) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); goto rc_NGX_ERROR; }
-    u_char *dn = ngx_pnalloc(r->pool, bind.len + 1);
-    if (!dn) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
-    if (location_conf->bind) (void) ngx_cpystrn(dn, bind.data, bind.len + 1); else {
-//        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: context->lud->lud_dn = %s", context->lud->lud_dn);
-        u_char *p = ngx_copy(dn, r->headers_in.user.data, r->headers_in.user.len);
-        *p++ = '@';
-        for (char *q = context->lud->lud_dn; *q; ) {
-//            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: q = %s, *q = %c", q, *q);
-            switch (q[0]) {
-                case 'D': case 'd': if (q[1]) switch (q[1]) {
-                    case 'C': case 'c': if (q[2]) switch (q[2]) {
-                        case '=': q += 3; continue;
-                    } break;
-                } break;
-                case ',': *p++ = '.'; q++; continue;
-            }
-            *p++ = *q++;
-        }
-        *p = '\0';
-//        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: dn = %s", dn);
+    ngx_http_auth_basic_ldap_retry(r, NGX_HTTP_GATEWAY_TIME_OUT);
+    if (context->rc != NGX_AGAIN) ngx_http_auth_basic_ldap_wake(r);
+}
+
+static void ngx_http_auth_basic_ldap_resolve_handler(ngx_resolver_ctx_t *ctx) {
+    ngx_http_request_t *r = ctx->data;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    if (ctx->state) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: %V could not be resolved (%i: %s)", &ctx->name, ctx->state, ngx_resolver_strerror(ctx->state)); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    if (!(context->addrs = ngx_pcalloc(r->pool, ctx->naddrs * sizeof(ngx_addr_t)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    for (ngx_uint_t i = 0; i < ctx->naddrs; i++) {
+        ngx_addr_t *addr = &context->addrs[i];
+        addr->socklen = ctx->addrs[i].socklen;
+        if (!(addr->sockaddr = ngx_palloc(r->pool, addr->socklen))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_palloc"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        ngx_memcpy(addr->sockaddr, ctx->addrs[i].sockaddr, addr->socklen);
+        ngx_inet_set_port(addr->sockaddr, (in_port_t)context->lud->lud_port);
+        if (!(addr->name.data = ngx_pnalloc(r->pool, NGX_SOCKADDR_STRLEN))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); goto rc_NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        addr->name.len = ngx_sock_ntop(addr->sockaddr, addr->socklen, addr->name.data, NGX_SOCKADDR_STRLEN, 1);
     }
-    struct berval cred = {r->headers_in.passwd.len, (char *)r->headers_in.passwd.data};
-    if ((rc = ldap_sasl_bind(context->ldap, (const char *)dn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, &context->msgid)) != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_sasl_bind failed: %s", ldap_err2string(rc)); goto ngx_http_auth_basic_ldap_set_realm; }
-ngx_http_core_run_phases:
-    if (ngx_handle_write_event(ev, 0) != NGX_OK) context->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
-    if (context->rc != NGX_AGAIN) { ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: Waking authentication request \"%V\"", &r->request_line); ngx_http_core_run_phases(r); }
-    return;
-ngx_http_auth_basic_ldap_set_realm:
-    context->rc = ngx_http_auth_basic_ldap_set_realm(r);
+    context->naddrs = ctx->naddrs;
+    ngx_resolve_name_done(ctx);
+    context->resolver = NULL;
+    if (ngx_http_auth_basic_ldap_start(r) != NGX_OK) context->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
     goto ngx_http_core_run_phases;
 rc_NGX_HTTP_INTERNAL_SERVER_ERROR:
+    ngx_resolve_name_done(ctx);
+    context->resolver = NULL;
     context->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
-    goto ngx_http_core_run_phases;
-rc_NGX_ERROR:
-    context->rc = NGX_ERROR;
-    goto ngx_http_core_run_phases;
+ngx_http_core_run_phases:
+    if (context->rc != NGX_AGAIN && !context->resolving) ngx_http_auth_basic_ldap_wake(r);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_resolve(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    if (!context->lud->lud_host) return NGX_DECLINED;
+    ngx_str_t host = {ngx_strlen(context->lud->lud_host), (u_char *)context->lud->lud_host};
+    if (!host.len || ngx_inet_addr(host.data, host.len) != INADDR_NONE || ngx_strlchr(host.data, host.data + host.len, ':')) return NGX_DECLINED;
+    ngx_http_core_loc_conf_t *core_loc_conf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    ngx_resolver_ctx_t *ctx = ngx_resolve_start(core_loc_conf->resolver, NULL);
+    if (!ctx) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_resolve_start"); return NGX_ERROR; }
+    if (ctx == NGX_NO_RESOLVER) return NGX_DECLINED;
+    ctx->name = host;
+    ctx->handler = ngx_http_auth_basic_ldap_resolve_handler;
+    ctx->data = r;
+    ctx->timeout = core_loc_conf->resolver_timeout;
+    context->resolver = ctx;
+    context->resolving = 1;
+    if (ngx_resolve_name(ctx) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_resolve_name != NGX_OK"); context->resolver = NULL; context->resolving = 0; return NGX_ERROR; }
+    context->resolving = 0;
+    return NGX_OK;
+}
+
+static void ngx_http_auth_basic_ldap_flight_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+    ngx_rbtree_node_t **p;
+    for (;;) {
+        if (node->key < temp->key) p = &temp->left;
+        else if (node->key > temp->key) p = &temp->right;
+        else p = ngx_memcmp(((ngx_http_auth_basic_ldap_context_t *)((u_char *)node - offsetof(ngx_http_auth_basic_ldap_context_t, flight)))->key, ((ngx_http_auth_basic_ldap_context_t *)((u_char *)temp - offsetof(ngx_http_auth_basic_ldap_context_t, flight)))->key, NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN) < 0 ? &temp->left : &temp->right;
+        if (*p == sentinel) break;
+        temp = *p;
+    }
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_flight(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf = ngx_http_get_module_main_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_rbtree_key_t hash = ngx_crc32_short(context->key, NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN);
+    ngx_rbtree_node_t *node = main_conf->flights.root;
+    while (node != &main_conf->sentinel) {
+        if (hash < node->key) { node = node->left; continue; }
+        if (hash > node->key) { node = node->right; continue; }
+        ngx_http_auth_basic_ldap_context_t *leader = (ngx_http_auth_basic_ldap_context_t *)((u_char *)node - offsetof(ngx_http_auth_basic_ldap_context_t, flight));
+        ngx_int_t rc = ngx_memcmp(context->key, leader->key, NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN);
+        if (rc) { node = rc < 0 ? node->left : node->right; continue; }
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: wait for authentication request \"%V\"", &leader->request->request_line);
+        ngx_queue_insert_tail(&leader->followers, &context->follower);
+        context->leader = leader;
+        return NGX_AGAIN;
+    }
+    context->flight.key = hash;
+    ngx_rbtree_insert(&main_conf->flights, &context->flight);
+    ngx_queue_init(&context->followers);
+    context->leading = 1;
+    return NGX_OK;
+}
+
+static void ngx_http_auth_basic_ldap_follower_handler(ngx_event_t *ev) {
+    ngx_http_request_t *r = ev->data;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    if (context->rc != NGX_AGAIN) { ngx_http_auth_basic_ldap_wake(r); return; }
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: restart authentication request");
+    ngx_http_set_ctx(r, NULL, ngx_http_auth_basic_ldap_module);
+    ngx_http_core_run_phases(r);
+}
+
+static void ngx_http_auth_basic_ldap_flight_done(ngx_http_auth_basic_ldap_context_t *context) {
+    ngx_http_request_t *r = context->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf = ngx_http_get_module_main_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_rbtree_delete(&main_conf->flights, &context->flight);
+    context->leading = 0;
+    while (!ngx_queue_empty(&context->followers)) {
+        ngx_queue_t *q = ngx_queue_head(&context->followers);
+        ngx_queue_remove(q);
+        ngx_http_auth_basic_ldap_context_t *follower = ngx_queue_data(q, ngx_http_auth_basic_ldap_context_t, follower);
+        ngx_http_request_t *fr = follower->request;
+        follower->leader = NULL;
+        switch (context->rc) {
+            case NGX_AGAIN: if (follower->background) follower->rc = NGX_ERROR; break;
+            case NGX_HTTP_UNAUTHORIZED: follower->rc = ngx_http_auth_basic_ldap_set_realm(fr); break;
+            case NGX_OK: {
+                if (context->attrs && context->attrs->nelts) {
+                    if (!(follower->attrs = ngx_array_create(fr->pool, context->attrs->nelts, sizeof(ngx_keyval_t)))) { ngx_log_error(NGX_LOG_ERR, fr->connection->log, 0, "!ngx_array_create"); follower->rc = NGX_HTTP_INTERNAL_SERVER_ERROR; break; }
+                    ngx_keyval_t *elts = context->attrs->elts;
+                    ngx_keyval_t *keyval = NULL;
+                    for (ngx_uint_t i = 0; i < context->attrs->nelts; i++) {
+                        ngx_str_t key = keyval && elts[i].key.data == elts[i - 1].key.data ? keyval->key : (ngx_str_t){elts[i].key.len, ngx_pstrdup(fr->pool, &elts[i].key)};
+                        if (!(keyval = ngx_array_push(follower->attrs))) break;
+                        keyval->key = key;
+                        keyval->value.len = elts[i].value.len;
+                        if (!key.data || !(keyval->value.data = ngx_pstrdup(fr->pool, &elts[i].value))) { keyval = NULL; break; }
+                    }
+                    if (!keyval) { ngx_log_error(NGX_LOG_ERR, fr->connection->log, 0, "!ngx_pstrdup"); follower->rc = NGX_HTTP_INTERNAL_SERVER_ERROR; break; }
+                }
+                if (context->groups) {
+                    if (!(follower->groups = ngx_array_create(fr->pool, context->groups->nelts ? context->groups->nelts : 1, sizeof(uint32_t)))) { ngx_log_error(NGX_LOG_ERR, fr->connection->log, 0, "!ngx_array_create"); follower->rc = NGX_HTTP_INTERNAL_SERVER_ERROR; break; }
+                    ngx_memcpy(follower->groups->elts, context->groups->elts, sizeof(uint32_t) * context->groups->nelts);
+                    follower->groups->nelts = context->groups->nelts;
+                }
+                follower->rc = ngx_http_auth_basic_ldap_headers(fr);
+            } break;
+            default: follower->rc = context->rc; break;
+        }
+        if (follower->rc != NGX_AGAIN) follower->stale = 0;
+        follower->event.handler = ngx_http_auth_basic_ldap_follower_handler;
+        ngx_post_event(&follower->event, &ngx_posted_events);
+    }
+}
+
+static void ngx_http_auth_basic_ldap_cleanup(void *data) {
+    ngx_http_auth_basic_ldap_context_t *context = data;
+    ngx_http_request_t *r = context->request;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    if (context->leader) { ngx_queue_remove(&context->follower); context->leader = NULL; }
+    if (context->leading) ngx_http_auth_basic_ldap_flight_done(context);
+    if (context->event.timer_set) ngx_del_timer(&context->event);
+    if (context->event.posted) ngx_delete_posted_event(&context->event);
+    ngx_http_auth_basic_ldap_servers_free(context, context->rc != NGX_AGAIN && context->responded ? NGX_OK : NGX_DECLINED);
+    if (context->resolver) { ngx_resolve_name_done(context->resolver); context->resolver = NULL; }
+    if (context->service) { if (!context->waiting) (void) ldap_abandon_ext(context->service->ldap, context->msgid, NULL, NULL); ngx_http_auth_basic_ldap_service_detach(r); }
+    if (context->lud) { if (!context->lud_static) ldap_free_urldesc(context->lud); context->lud = NULL; }
+    if (context->result) { ldap_msgfree(context->result); context->result = NULL; }
+    if (context->peer_connection.connection && context->ldap && context->keepalive && context->rc != NGX_AGAIN && ngx_http_auth_basic_ldap_keepalive_put(r) == NGX_OK) return;
+    if (context->peer_connection.connection) { ngx_http_auth_basic_ldap_close(context->peer_connection.connection, context->ldap); context->peer_connection.connection = NULL; context->ldap = NULL; }
+    if (context->ldap) { ldap_unbind_ext(context->ldap, NULL, NULL); context->ldap = NULL; }
+}
+
+static void ngx_http_auth_basic_ldap_release(ngx_http_auth_basic_ldap_context_t *context) {
+    if (!context->cleanup) return;
+    context->cleanup->handler = NULL;
+    context->cleanup = NULL;
+    ngx_http_auth_basic_ldap_cleanup(context);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_authenticate(ngx_http_request_t *r, ngx_str_t *url) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (!cln) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pool_cleanup_add"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    cln->handler = ngx_http_auth_basic_ldap_cleanup;
+    cln->data = context;
+    context->cleanup = cln;
+    if (location_conf->lud) { context->lud = location_conf->lud; context->lud_static = 1; } else {
+        u_char *urlc = ngx_pnalloc(r->pool, url->len + 1);
+        if (!urlc) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        (void) ngx_cpystrn(urlc, url->data, url->len + 1);
+        int rc = ldap_url_parse((const char *)urlc, &context->lud);
+        if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_url_parse failed: %s", ldap_err2string(rc)); return NGX_ERROR; }
+    }
+    if (!location_conf->bind && !context->lud->lud_dn) return NGX_DECLINED;
+#if (NGX_SSL)
+    if (!location_conf->ssl && context->lud->lud_scheme && !ngx_strcasecmp((u_char *)context->lud->lud_scheme, (u_char *)"ldaps")) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: no \"auth_basic_ldap_ssl_trusted_certificate\" is defined for TLS url"); return NGX_ERROR; }
+    if (location_conf->ssl && context->lud->lud_scheme && !ngx_strcasecmp((u_char *)context->lud->lud_scheme, (u_char *)"ldaps")) context->ssl = location_conf->ssl;
+    else if (location_conf->ssl && location_conf->starttls) { context->ssl = location_conf->ssl; context->starttls = 1; }
+#endif
+    context->rc = NGX_AGAIN;
+    context->begin = ngx_current_msec;
+    if (location_conf->coalesce && ngx_http_auth_basic_ldap_flight(r) == NGX_AGAIN) return NGX_AGAIN;
+    switch (ngx_http_auth_basic_ldap_resolve(r)) {
+        case NGX_ERROR: context->rc = NGX_ERROR; break;
+        case NGX_DECLINED: {
+            if (context->lud_static && location_conf->naddrs) { context->addrs = location_conf->addrs; context->naddrs = location_conf->naddrs; } else {
+                ngx_url_t ngx_url;
+                ngx_memzero(&ngx_url, sizeof(ngx_url_t));
+                ngx_url.url.data = (u_char *) context->lud->lud_host;
+                ngx_url.url.len = ngx_strlen(context->lud->lud_host);
+                ngx_url.default_port = context->lud->lud_port;
+                if (ngx_parse_url(r->pool, &ngx_url) != NGX_OK) {
+                    if (ngx_url.err) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: %s in LDAP hostname \"%V\"", ngx_url.err, &ngx_url.url); }
+                    else { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_parse_url != NGX_OK"); }
+                    return NGX_ERROR;
+                }
+                context->addrs = ngx_url.addrs;
+                context->naddrs = ngx_url.naddrs;
+            }
+            if (ngx_http_auth_basic_ldap_start(r) != NGX_OK) context->rc = NGX_ERROR;
+        } break;
+    }
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_background(ngx_http_request_t *r, ngx_str_t *url) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_context_t *background = ngx_pcalloc(r->pool, sizeof(ngx_http_auth_basic_ldap_context_t));
+    if (!background) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_ERROR; }
+    ngx_http_request_t *br;
+    if (ngx_http_subrequest(r, &r->uri, &r->args, &br, NULL, NGX_HTTP_SUBREQUEST_BACKGROUND) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_subrequest != NGX_OK"); return NGX_ERROR; }
+    br->write_event_handler = ngx_http_request_empty_handler;
+    br->loc_conf = r->loc_conf;
+    background->realm = context->realm;
+    background->request = br;
+    background->event.handler = ngx_http_auth_basic_ldap_timeout_handler;
+    background->event.data = br;
+    background->event.log = r->connection->log;
+    background->background = 1;
+    ngx_memcpy(background->key, context->key, NGX_HTTP_AUTH_BASIC_LDAP_KEY_LEN);
+    ngx_http_set_ctx(br, background, ngx_http_auth_basic_ldap_module);
+    switch (ngx_http_auth_basic_ldap_authenticate(br, url)) {
+        case NGX_OK: break;
+        case NGX_AGAIN: return NGX_OK;
+        default: ngx_http_auth_basic_ldap_release(background); ngx_http_finalize_request(br, NGX_DONE); return NGX_ERROR;
+    }
+    if (background->rc != NGX_AGAIN) ngx_http_auth_basic_ldap_wake(br);
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_stale(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: using stale authentication result instead of %i", context->rc);
+    if (r->headers_out.www_authenticate) { r->headers_out.www_authenticate->hash = 0; r->headers_out.www_authenticate = NULL; }
+    context->stale = 0;
+    context->cacheable = 0;
+    context->cache_status = NGX_HTTP_AUTH_BASIC_LDAP_CACHE_STALE;
+    context->attrs = context->stale_attrs;
+    context->groups = context->stale_groups;
+    return context->stale_rc == NGX_OK ? ngx_http_auth_basic_ldap_headers(r) : ngx_http_auth_basic_ldap_set_realm(r);
 }
 
 static ngx_int_t ngx_http_auth_basic_ldap_handler(ngx_http_request_t *r) {
@@ -300,6 +3183,10 @@ static ngx_int_t ngx_http_auth_basic_ldap_handler(ngx_http_request_t *r) {
         context = ngx_pcalloc(r->pool, sizeof(ngx_http_auth_basic_ldap_context_t));
         if (!context) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
         ngx_str_set(&context->realm, "Authenticate");
+        context->request = r;
+        context->event.handler = ngx_http_auth_basic_ldap_timeout_handler;
+        context->event.data = r;
+        context->event.log = r->connection->log;
         ngx_http_set_ctx(r, context, ngx_http_auth_basic_ldap_module);
         if (location_conf->realm && ngx_http_complex_value(r, location_conf->realm, &context->realm) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); return NGX_ERROR; }
         if (context->realm.len == sizeof("off") - 1 && ngx_strncasecmp(context->realm.data, (u_char *)"off", sizeof("off") - 1) == 0) return NGX_DECLINED;
@@ -310,54 +3197,143 @@ static ngx_int_t ngx_http_auth_basic_ldap_handler(ngx_http_request_t *r) {
         if (!r->headers_in.passwd.len) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: no password was provided for basic authentication"); return ngx_http_auth_basic_ldap_set_realm(r); }
         ngx_str_t url;
         if (ngx_http_complex_value(r, location_conf->url, &url) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); return NGX_ERROR; }
-        u_char *urlc = ngx_pnalloc(r->pool, url.len + 1);
-        if (!urlc) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
-        (void) ngx_cpystrn(urlc, url.data, url.len + 1);
-        ngx_url_t ngx_url;
-        ngx_memzero(&ngx_url, sizeof(ngx_url_t));
-        int rc = ldap_url_parse((const char *)urlc, &context->lud);
-        if (rc != LDAP_SUCCESS) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: ldap_url_parse failed: %s", ldap_err2string(rc)); return NGX_ERROR; }
-        if (!location_conf->bind && !context->lud->lud_dn) { ldap_free_urldesc(context->lud); return NGX_DECLINED; }
-        ngx_url.url.data = (u_char *) context->lud->lud_host;
-        ngx_url.url.len = ngx_strlen(context->lud->lud_host);
-        ngx_url.default_port = context->lud->lud_port;
-        if (ngx_parse_url(r->pool, &ngx_url) != NGX_OK) {
-            if (ngx_url.err) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: %s in LDAP hostname \"%V\"", ngx_url.err, &ngx_url.url); }
-            else { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_parse_url != NGX_OK"); }
-            ldap_free_urldesc(context->lud);
-            return NGX_ERROR;
-        }
-        ngx_addr_t *addr = &ngx_url.addrs[ngx_random() % ngx_url.naddrs];
-        context->peer_connection.sockaddr = addr->sockaddr;
-        context->peer_connection.socklen = addr->socklen;
-        context->peer_connection.name = &addr->name;
-        context->peer_connection.get = ngx_event_get_peer;
-        context->peer_connection.log = r->connection->log;
-        context->peer_connection.log_error = r->connection->log_error;
-        switch (ngx_event_connect_peer(&context->peer_connection)) {
-            case NGX_ERROR: case NGX_BUSY: case NGX_DECLINED: {
-                if (context->peer_connection.connection) ngx_close_connection(context->peer_connection.connection);
-                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ldap: Unable to connect to LDAP server \"%V\"", &addr->name);
-                ldap_free_urldesc(context->lud);
-                return NGX_ERROR;
+        ngx_int_t rc;
+        if (location_conf->cache) {
+            ngx_http_auth_basic_ldap_cache_t *cache = location_conf->cache->data;
+            if (ngx_http_auth_basic_ldap_cache_key(r, cache->sh->secret, &url, context->key) != NGX_OK) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            switch ((rc = ngx_http_auth_basic_ldap_cache_get(r))) {
+                case NGX_OK: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: cache hit = %i", context->rc); context->cache_status = NGX_HTTP_AUTH_BASIC_LDAP_CACHE_HIT; if (context->rc != NGX_OK && location_conf->fail_limit) (void) ngx_http_auth_basic_ldap_fail_limit(r, 1); return ngx_http_auth_basic_ldap_require(r, context->rc == NGX_OK ? ngx_http_auth_basic_ldap_headers(r) : ngx_http_auth_basic_ldap_set_realm(r));
+                case NGX_ERROR: return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                case NGX_DECLINED: context->cache_status = NGX_HTTP_AUTH_BASIC_LDAP_CACHE_MISS; break;
+                case NGX_AGAIN: case NGX_BUSY: {
+                    if (location_conf->cache_use_stale & NGX_HTTP_AUTH_BASIC_LDAP_STALE_UPDATING && (rc == NGX_BUSY || location_conf->cache_background_update)) {
+                        if (rc == NGX_AGAIN && ngx_http_auth_basic_ldap_background(r, &url) != NGX_OK) ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ldap: background update failed");
+                        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ldap: cache stale = %i", context->rc);
+                        context->cache_status = NGX_HTTP_AUTH_BASIC_LDAP_CACHE_UPDATING;
+                        if (context->rc != NGX_OK && location_conf->fail_limit) (void) ngx_http_auth_basic_ldap_fail_limit(r, 1);
+                        return ngx_http_auth_basic_ldap_require(r, context->rc == NGX_OK ? ngx_http_auth_basic_ldap_headers(r) : ngx_http_auth_basic_ldap_set_realm(r));
+                    }
+                    context->stale_rc = context->rc;
+                    context->stale_attrs = context->attrs;
+                    context->attrs = NULL;
+                    context->stale_groups = context->groups;
+                    context->groups = NULL;
+                    context->stale = 1;
+                    context->cache_status = NGX_HTTP_AUTH_BASIC_LDAP_CACHE_EXPIRED;
+                } break;
             }
+        } else if (location_conf->coalesce) {
+            ngx_http_auth_basic_ldap_main_conf_t *main_conf = ngx_http_get_module_main_conf(r, ngx_http_auth_basic_ldap_module);
+            if (ngx_http_auth_basic_ldap_cache_key(r, main_conf->secret, &url, context->key) != NGX_OK) return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
-        context->peer_connection.connection->log = r->connection->log;
-        context->peer_connection.connection->log_error = r->connection->log_error;
-        context->peer_connection.connection->read->handler = ngx_http_auth_basic_ldap_read_handler;
-        context->peer_connection.connection->write->handler = ngx_http_auth_basic_ldap_write_handler;
-        context->peer_connection.connection->read->log = r->connection->log;
-        context->peer_connection.connection->write->log = r->connection->log;
-        context->peer_connection.connection->data = r;
-        context->rc = NGX_AGAIN;
-    } else if (context->rc != NGX_AGAIN) {
-        if (context->lud) { ldap_free_urldesc(context->lud); context->lud = NULL; }
-        if (context->result) { ldap_msgfree(context->result); context->result = NULL; }
-        if (context->peer_connection.connection) { ngx_close_connection(context->peer_connection.connection); context->peer_connection.connection = NULL; }
-        if (context->ldap) { ldap_unbind_ext(context->ldap, NULL, NULL); context->ldap = NULL; }
+        if (location_conf->fail_limit && ngx_http_auth_basic_ldap_fail_limit(r, 0) == NGX_BUSY) return location_conf->fail_status == NGX_HTTP_UNAUTHORIZED ? ngx_http_auth_basic_ldap_set_realm(r) : (ngx_int_t)location_conf->fail_status;
+        if ((rc = ngx_http_auth_basic_ldap_authenticate(r, &url)) != NGX_OK) return rc;
+    }
+    if (context->rc != NGX_AGAIN) {
+        if (context->begin) context->time = ngx_current_msec - context->begin;
+        if (context->stale && !context->cacheable && context->rc != NGX_OK && location_conf->cache_use_stale & (context->rc == NGX_HTTP_GATEWAY_TIME_OUT ? NGX_HTTP_AUTH_BASIC_LDAP_STALE_TIMEOUT : NGX_HTTP_AUTH_BASIC_LDAP_STALE_ERROR)) context->rc = ngx_http_auth_basic_ldap_stale(r);
+        if (context->cacheable && context->rc == NGX_HTTP_UNAUTHORIZED && location_conf->fail_limit) (void) ngx_http_auth_basic_ldap_fail_limit(r, 1);
+        if (context->cacheable && location_conf->cache) { ngx_http_auth_basic_ldap_cache_set(r); context->cacheable = 0; }
+        ngx_http_auth_basic_ldap_release(context);
     }
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s = %i", __func__, context->rc);
-    return context->rc;
+    return ngx_http_auth_basic_ldap_require(r, context->rc);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_attr_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_str_t *name = (ngx_str_t *)data;
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    if (!context || context->rc != NGX_OK || !context->attrs) { v->not_found = 1; return NGX_OK; }
+    ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_ldap_module);
+    u_char *attr = name->data + sizeof("ldap_attr_") - 1;
+    size_t len = name->len - (sizeof("ldap_attr_") - 1);
+    ngx_uint_t all = len > sizeof("_all") - 1 && !ngx_strncmp(attr + len - (sizeof("_all") - 1), "_all", sizeof("_all") - 1);
+    if (all) len -= sizeof("_all") - 1;
+    ngx_keyval_t *elts = context->attrs->elts;
+    ngx_str_t *key = NULL;
+    ngx_uint_t first = 0, n = 0;
+    size_t size = 0;
+    for (ngx_uint_t i = 0; i < context->attrs->nelts; i++) {
+        if (!key || elts[i].key.data != key->data) {
+            if (n) break;
+            key = &elts[i].key;
+            if (key->len != len) continue;
+            size_t j;
+            for (j = 0; j < len; j++) if (ngx_tolower(key->data[j]) != (attr[j] == '_' ? '-' : attr[j])) break;
+            if (j < len) continue;
+            first = i;
+        } else if (!n) continue;
+        if (!all) { n = 1; size = elts[i].value.len; break; }
+        size += (n++ ? location_conf->attr_separator.len : 0) + elts[i].value.len;
+    }
+    if (!n) { v->not_found = 1; return NGX_OK; }
+    if (!all) v->data = elts[first].value.data; else {
+        u_char *p = ngx_pnalloc(r->pool, size);
+        if (!p) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+        v->data = p;
+        for (ngx_uint_t i = first; i < first + n; i++) {
+            if (i > first) p = ngx_copy(p, location_conf->attr_separator.data, location_conf->attr_separator.len);
+            p = ngx_copy(p, elts[i].value.data, elts[i].value.len);
+        }
+    }
+    v->len = size;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_cache_status_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    if (!context || !context->cache_status) { v->not_found = 1; return NGX_OK; }
+    v->len = ngx_http_auth_basic_ldap_cache_statuses[context->cache_status].len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = ngx_http_auth_basic_ldap_cache_statuses[context->cache_status].data;
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_server_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    if (!context || !context->peer_connection.name) { v->not_found = 1; return NGX_OK; }
+    v->len = context->peer_connection.name->len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = context->peer_connection.name->data;
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_time_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_auth_basic_ldap_context_t *context = ngx_http_get_module_ctx(r, ngx_http_auth_basic_ldap_module);
+    if (!context || !context->begin || context->rc == NGX_AGAIN) { v->not_found = 1; return NGX_OK; }
+    u_char *p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + 4);
+    if (!p) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+    v->len = ngx_sprintf(p, "%T.%03M", (time_t)context->time / 1000, context->time % 1000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+    return NGX_OK;
+}
+
+static ngx_http_variable_t ngx_http_auth_basic_ldap_variables[] = {
+  { ngx_string("ldap_attr_"), NULL, ngx_http_auth_basic_ldap_attr_variable, 0, NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_PREFIX, 0 },
+  { ngx_string("auth_basic_ldap_cache_status"), NULL, ngx_http_auth_basic_ldap_cache_status_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+  { ngx_string("auth_basic_ldap_server"), NULL, ngx_http_auth_basic_ldap_server_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+  { ngx_string("auth_basic_ldap_time"), NULL, ngx_http_auth_basic_ldap_time_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    ngx_http_null_variable
+};
+
+static ngx_int_t ngx_http_auth_basic_ldap_preconfiguration(ngx_conf_t *cf) {
+    for (ngx_http_variable_t *v = ngx_http_auth_basic_ldap_variables; v->name.len; v++) {
+        ngx_http_variable_t *variable = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (!variable) return NGX_ERROR;
+        variable->get_handler = v->get_handler;
+        variable->data = v->data;
+    }
+    return NGX_OK;
 }
 
 static ngx_int_t ngx_http_auth_basic_ldap_postconfiguration(ngx_conf_t *cf) {
@@ -365,16 +3341,225 @@ static ngx_int_t ngx_http_auth_basic_ldap_postconfiguration(ngx_conf_t *cf) {
     ngx_http_handler_pt *handler = ngx_array_push(&core_main_conf->phases[NGX_HTTP_ACCESS_PHASE].handlers);
     if (!handler) return NGX_ERROR;
     *handler = ngx_http_auth_basic_ldap_handler;
-    return NGX_OK;
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_auth_basic_ldap_module);
+    ngx_http_auth_basic_ldap_sync_t **syncs = main_conf->syncs.elts;
+    for (ngx_uint_t i = 0; i < main_conf->syncs.nelts; i++) if (!syncs[i]->cache) { ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "\"auth_basic_ldap_cache_sync\" requires \"auth_basic_ldap_cache\" zone"); return NGX_ERROR; }
+    if (!main_conf->groups.nelts) return NGX_OK;
+    ngx_array_t keys;
+    if (ngx_array_init(&keys, cf->temp_pool, main_conf->groups.nelts, sizeof(ngx_hash_key_t)) != NGX_OK) return NGX_ERROR;
+    ngx_str_t *groups = main_conf->groups.elts;
+    size_t len = 0;
+    uint32_t generation;
+    ngx_crc32_init(generation);
+    for (ngx_uint_t i = 0; i < main_conf->groups.nelts; i++) {
+        ngx_hash_key_t *key = ngx_array_push(&keys);
+        if (!key) return NGX_ERROR;
+        key->key = groups[i];
+        key->key_hash = ngx_hash_key_lc(groups[i].data, groups[i].len);
+        key->value = (void *)(uintptr_t)(i + 1);
+        ngx_crc32_update(&generation, groups[i].data, groups[i].len);
+        ngx_crc32_update(&generation, (u_char *)"", 1);
+        if (groups[i].len > len) len = groups[i].len;
+    }
+    ngx_crc32_final(generation);
+    main_conf->generation = generation ? generation : 1;
+    ngx_hash_init_t hash;
+    hash.hash = &main_conf->group_hash;
+    hash.key = ngx_hash_key_lc;
+    hash.max_size = ngx_max(512, 4 * main_conf->groups.nelts);
+    hash.bucket_size = ngx_align(ngx_max(64, len + 4 * sizeof(void *)), ngx_cacheline_size);
+    hash.name = "auth_basic_ldap_group_hash";
+    hash.pool = cf->pool;
+    hash.temp_pool = NULL;
+    return ngx_hash_init(&hash, keys.elts, keys.nelts);
+}
+
+static void *ngx_http_auth_basic_ldap_create_main_conf(ngx_conf_t *cf) {
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_basic_ldap_main_conf_t));
+    if (!main_conf) return NULL;
+    main_conf->keepalive = NGX_CONF_UNSET_UINT;
+    main_conf->keepalive_timeout = NGX_CONF_UNSET_MSEC;
+    main_conf->service_connections = NGX_CONF_UNSET_UINT;
+    if (ngx_array_init(&main_conf->syncs, cf->pool, 1, sizeof(ngx_http_auth_basic_ldap_sync_t *)) != NGX_OK) return NULL;
+    if (ngx_array_init(&main_conf->groups, cf->pool, 4, sizeof(ngx_str_t)) != NGX_OK) return NULL;
+    return main_conf;
+}
+
+static char *ngx_http_auth_basic_ldap_init_main_conf(ngx_conf_t *cf, void *conf) {
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf = conf;
+    ngx_conf_init_uint_value(main_conf->keepalive, 0);
+    ngx_conf_init_msec_value(main_conf->keepalive_timeout, 60000);
+    ngx_conf_init_uint_value(main_conf->service_connections, 1);
+    ngx_queue_init(&main_conf->cache);
+    ngx_queue_init(&main_conf->free);
+    ngx_queue_init(&main_conf->service);
+    ngx_rbtree_init(&main_conf->flights, &main_conf->sentinel, ngx_http_auth_basic_ldap_flight_insert_value);
+    ngx_http_auth_basic_ldap_secret(main_conf->secret);
+    if (!main_conf->keepalive) return NGX_CONF_OK;
+    ngx_http_auth_basic_ldap_keepalive_t *keepalive = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_basic_ldap_keepalive_t) * main_conf->keepalive);
+    if (!keepalive) return NGX_CONF_ERROR;
+    for (ngx_uint_t i = 0; i < main_conf->keepalive; i++) {
+        keepalive[i].main_conf = main_conf;
+        ngx_queue_insert_head(&main_conf->free, &keepalive[i].queue);
+    }
+    return NGX_CONF_OK;
 }
 
 static void *ngx_http_auth_basic_ldap_create_loc_conf(ngx_conf_t *cf) {
     ngx_http_auth_basic_ldap_location_conf_t *location_conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_basic_ldap_location_conf_t));
     if (!location_conf) return NULL;
     location_conf->attrs = NGX_CONF_UNSET_PTR;
+    location_conf->coalesce = NGX_CONF_UNSET;
+    location_conf->headers = NGX_CONF_UNSET;
+    location_conf->cache_background_update = NGX_CONF_UNSET;
+    location_conf->bind_timeout = NGX_CONF_UNSET_MSEC;
+    location_conf->connect_timeout = NGX_CONF_UNSET_MSEC;
+    location_conf->search_timeout = NGX_CONF_UNSET_MSEC;
+    location_conf->servers = NGX_CONF_UNSET_PTR;
+    location_conf->tries = NGX_CONF_UNSET_UINT;
+    location_conf->cache = NGX_CONF_UNSET_PTR;
+    location_conf->cache_sync = NGX_CONF_UNSET_PTR;
+    location_conf->fail_limit = NGX_CONF_UNSET_PTR;
+    location_conf->require = NGX_CONF_UNSET_PTR;
+    location_conf->nested_groups = NGX_CONF_UNSET;
+    location_conf->cache_invalid = NGX_CONF_UNSET;
+    location_conf->cache_stale = NGX_CONF_UNSET;
+    location_conf->cache_valid = NGX_CONF_UNSET;
+#if (NGX_SSL)
+    location_conf->ssl_server_name = NGX_CONF_UNSET;
+    location_conf->ssl_session_reuse = NGX_CONF_UNSET;
+    location_conf->ssl_verify = NGX_CONF_UNSET;
+    location_conf->ssl_verify_depth = NGX_CONF_UNSET_UINT;
+    location_conf->starttls = NGX_CONF_UNSET;
+#endif
     return location_conf;
 }
 
+static char *ngx_http_auth_basic_ldap_url_compile(ngx_conf_t *cf, ngx_http_auth_basic_ldap_location_conf_t *location_conf) {
+    if (!location_conf->url || location_conf->url->lengths || location_conf->lud) return NGX_CONF_OK;
+    u_char *url = ngx_pnalloc(cf->pool, location_conf->url->value.len + 1);
+    if (!url) return "!ngx_pnalloc";
+    (void) ngx_cpystrn(url, location_conf->url->value.data, location_conf->url->value.len + 1);
+    LDAPURLDesc *lud;
+    int rc = ldap_url_parse((const char *)url, &lud);
+    if (rc != LDAP_SUCCESS) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "ldap_url_parse failed: %s", ldap_err2string(rc)); return NGX_CONF_ERROR; }
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (!cln) { ldap_free_urldesc(lud); return "!ngx_pool_cleanup_add"; }
+    cln->handler = ngx_http_auth_basic_ldap_url_cleanup;
+    cln->data = lud;
+    if (lud->lud_dn) {
+        if (!(location_conf->domain.data = ngx_pnalloc(cf->pool, sizeof("@") - 1 + ngx_strlen(lud->lud_dn)))) return "!ngx_pnalloc";
+        u_char *p = location_conf->domain.data;
+        *p++ = '@';
+        location_conf->domain.len = ngx_http_auth_basic_ldap_domain(p, lud->lud_dn) - location_conf->domain.data;
+    }
+    if (lud->lud_host) {
+        ngx_url_t ngx_url;
+        ngx_memzero(&ngx_url, sizeof(ngx_url_t));
+        ngx_url.url.data = (u_char *)lud->lud_host;
+        ngx_url.url.len = ngx_strlen(lud->lud_host);
+        ngx_url.default_port = lud->lud_port;
+        if (ngx_parse_url(cf->pool, &ngx_url) != NGX_OK) {
+            if (ngx_url.err) ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%s in LDAP hostname \"%V\"", ngx_url.err, &ngx_url.url);
+            return NGX_CONF_ERROR;
+        }
+        location_conf->addrs = ngx_url.addrs;
+        location_conf->naddrs = ngx_url.naddrs;
+    }
+    location_conf->lud = lud;
+    return NGX_CONF_OK;
+}
+
+static char *ngx_http_auth_basic_ldap_rules_compile(ngx_conf_t *cf, ngx_http_auth_basic_ldap_location_conf_t *location_conf) {
+#if (NGX_PCRE)
+    if (location_conf->attrs == NGX_CONF_UNSET_PTR || !location_conf->attrs->nelts) return NGX_CONF_OK;
+    ngx_str_t header = ngx_null_string;
+    if (location_conf->header && !location_conf->header->lengths) header = location_conf->header->value;
+    ngx_array_t keys;
+    if (ngx_array_init(&keys, cf->temp_pool, location_conf->attrs->nelts, sizeof(ngx_hash_key_t)) != NGX_OK) return "ngx_array_init != NGX_OK";
+    ngx_http_auth_basic_ldap_attr_t *attrs = location_conf->attrs->elts;
+    for (ngx_uint_t i = 0; i < location_conf->attrs->nelts; i++) {
+        if (!attrs[i].http_regex) continue;
+        if (attrs[i].attr.len > NGX_HTTP_AUTH_BASIC_LDAP_ATTR_LEN) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "too long attribute \"%V\"", &attrs[i].attr); return NGX_CONF_ERROR; }
+        ngx_hash_key_t *key = keys.elts;
+        ngx_uint_t j;
+        for (j = 0; j < keys.nelts; j++) if (key[j].key.len == attrs[i].attr.len && !ngx_strncasecmp(key[j].key.data, attrs[i].attr.data, attrs[i].attr.len)) break;
+        if (j < keys.nelts) continue;
+        ngx_http_auth_basic_ldap_rule_t *rule = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_basic_ldap_rule_t));
+        if (!rule) return "!ngx_pcalloc";
+        rule->attr = &attrs[i];
+        if (!location_conf->header || !location_conf->header->lengths) {
+            rule->key.len = header.len + attrs[i].attr.len;
+            if (!(rule->key.data = ngx_pnalloc(cf->pool, rule->key.len))) return "!ngx_pnalloc";
+            if (header.len) ngx_memcpy(rule->key.data, header.data, header.len);
+            ngx_memcpy(rule->key.data + header.len, attrs[i].attr.data, attrs[i].attr.len);
+            if (!(rule->lowcase_key = ngx_pnalloc(cf->pool, rule->key.len))) return "!ngx_pnalloc";
+            rule->hash = ngx_hash_strlow(rule->lowcase_key, rule->key.data, rule->key.len);
+        }
+        if (!(key = ngx_array_push(&keys))) return "!ngx_array_push";
+        if (!(key->key.data = ngx_pnalloc(cf->pool, attrs[i].attr.len))) return "!ngx_pnalloc";
+        key->key.len = attrs[i].attr.len;
+        key->key_hash = ngx_hash_strlow(key->key.data, attrs[i].attr.data, attrs[i].attr.len);
+        key->value = rule;
+    }
+    if (!keys.nelts) return NGX_CONF_OK;
+    ngx_hash_init_t hash;
+    hash.hash = &location_conf->rules;
+    hash.key = ngx_hash_key_lc;
+    hash.max_size = 512;
+    hash.bucket_size = ngx_align(64, ngx_cacheline_size);
+    hash.name = "auth_basic_ldap_attr_hash";
+    hash.pool = cf->pool;
+    hash.temp_pool = NULL;
+    if (ngx_hash_init(&hash, keys.elts, keys.nelts) != NGX_OK) return "ngx_hash_init != NGX_OK";
+#endif
+    return NGX_CONF_OK;
+}
+
+#if (NGX_SSL)
+static char *ngx_http_auth_basic_ldap_ssl_compile(ngx_conf_t *cf, ngx_http_auth_basic_ldap_location_conf_t *conf, ngx_http_auth_basic_ldap_location_conf_t *prev) {
+    if (!conf->url) return NGX_CONF_OK;
+    if (conf->lud && !conf->starttls && (!conf->lud->lud_scheme || ngx_strcasecmp((u_char *)conf->lud->lud_scheme, (u_char *)"ldaps"))) return NGX_CONF_OK;
+    if (conf->ssl_verify && !conf->ssl_trusted_certificate.len) {
+        if (!conf->lud && !conf->starttls) return NGX_CONF_OK;
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "no \"auth_basic_ldap_ssl_trusted_certificate\" is defined for TLS \"auth_basic_ldap_url\" (or \"auth_basic_ldap_ssl_verify off\" is needed)");
+        return NGX_CONF_ERROR;
+    }
+    if (prev->ssl && conf->ssl_verify == prev->ssl_verify && conf->ssl_verify_depth == prev->ssl_verify_depth && conf->ssl_session_reuse == prev->ssl_session_reuse && conf->ssl_trusted_certificate.data == prev->ssl_trusted_certificate.data) { conf->ssl = prev->ssl; return NGX_CONF_OK; }
+    if (!(conf->ssl = ngx_pcalloc(cf->pool, sizeof(ngx_ssl_t)))) return "!ngx_pcalloc";
+    conf->ssl->log = cf->log;
+    if (ngx_ssl_create(conf->ssl, NGX_SSL_TLSv1_2|NGX_SSL_TLSv1_3, NULL) != NGX_OK) return NGX_CONF_ERROR;
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (!cln) { ngx_ssl_cleanup_ctx(conf->ssl); return "!ngx_pool_cleanup_add"; }
+    cln->handler = ngx_ssl_cleanup_ctx;
+    cln->data = conf->ssl;
+    if (conf->ssl_verify && ngx_ssl_trusted_certificate(cf, conf->ssl, &conf->ssl_trusted_certificate, conf->ssl_verify_depth) != NGX_OK) return NGX_CONF_ERROR;
+    if (ngx_ssl_client_session_cache(cf, conf->ssl, conf->ssl_session_reuse) != NGX_OK) return NGX_CONF_ERROR;
+    return NGX_CONF_OK;
+}
+#endif
+
+static char *ngx_http_auth_basic_ldap_sync_compile(ngx_conf_t *cf, ngx_http_auth_basic_ldap_location_conf_t *conf) {
+    ngx_http_auth_basic_ldap_sync_t *sync = conf->cache_sync;
+    if (!sync || !conf->cache) return NGX_CONF_OK;
+    if (sync->cache) {
+        if (sync->cache != conf->cache) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"auth_basic_ldap_cache_sync\" is used with different \"auth_basic_ldap_cache\" zones"); return NGX_CONF_ERROR; }
+        return NGX_CONF_OK;
+    }
+    if (!conf->service_bind.data) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"auth_basic_ldap_cache_sync\" requires \"auth_basic_ldap_service_bind\""); return NGX_CONF_ERROR; }
+    sync->cache = conf->cache;
+    sync->location_conf = conf;
+#if (NGX_SSL)
+    ngx_uint_t ldaps = sync->lud->lud_scheme && !ngx_strcasecmp((u_char *)sync->lud->lud_scheme, (u_char *)"ldaps");
+    if (!ldaps && !conf->starttls) return NGX_CONF_OK;
+    if (!conf->ssl) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"auth_basic_ldap_cache_sync\" with TLS requires \"auth_basic_ldap_url\" with TLS"); return NGX_CONF_ERROR; }
+    sync->ssl = conf->ssl;
+    sync->starttls = !ldaps;
+    sync->ssl_name = ngx_http_auth_basic_ldap_ssl_name(conf, sync->lud);
+#endif
+    return NGX_CONF_OK;
+}
+
 static char *ngx_http_auth_basic_ldap_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child) {
     ngx_http_auth_basic_ldap_location_conf_t *prev = parent;
     ngx_http_auth_basic_ldap_location_conf_t *conf = child;
@@ -382,15 +3567,75 @@ static char *ngx_http_auth_basic_ldap_merge_loc_conf(ngx_conf_t *cf, void *paren
     if (!conf->header) conf->header = prev->header;
     if (!conf->realm) conf->realm = prev->realm;
     if (!conf->url) conf->url = prev->url;
+    char *rv;
+    if (conf->url == prev->url) {
+        if ((rv = ngx_http_auth_basic_ldap_url_compile(cf, prev)) != NGX_CONF_OK) return rv;
+        conf->lud = prev->lud;
+        conf->addrs = prev->addrs;
+        conf->naddrs = prev->naddrs;
+        conf->domain = prev->domain;
+    } else if ((rv = ngx_http_auth_basic_ldap_url_compile(cf, conf)) != NGX_CONF_OK) return rv;
+    if (!conf->service_bind.data) { conf->service_bind = prev->service_bind; conf->service_password = prev->service_password; }
     ngx_conf_merge_ptr_value(conf->attrs, prev->attrs, NGX_CONF_UNSET_PTR);
-    return NGX_CONF_OK;
+    ngx_conf_merge_str_value(conf->attr_separator, prev->attr_separator, "; ");
+    ngx_conf_merge_value(conf->headers, prev->headers, 0);
+    if ((rv = ngx_http_auth_basic_ldap_rules_compile(cf, conf)) != NGX_CONF_OK) return rv;
+    ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+    ngx_conf_merge_ptr_value(conf->cache_sync, prev->cache_sync, NULL);
+    ngx_conf_merge_sec_value(conf->cache_invalid, prev->cache_invalid, 0);
+    ngx_conf_merge_sec_value(conf->cache_stale, prev->cache_stale, 0);
+    ngx_conf_merge_sec_value(conf->cache_valid, prev->cache_valid, 60);
+    ngx_conf_merge_msec_value(conf->bind_timeout, prev->bind_timeout, 60000);
+    ngx_conf_merge_msec_value(conf->connect_timeout, prev->connect_timeout, 60000);
+    ngx_conf_merge_msec_value(conf->search_timeout, prev->search_timeout, 60000);
+    ngx_conf_merge_uint_value(conf->tries, prev->tries, 0);
+    ngx_conf_merge_value(conf->coalesce, prev->coalesce, 0);
+    ngx_conf_merge_value(conf->cache_background_update, prev->cache_background_update, 0);
+    ngx_conf_merge_bitmask_value(conf->cache_use_stale, prev->cache_use_stale, NGX_CONF_BITMASK_SET|NGX_HTTP_AUTH_BASIC_LDAP_STALE_OFF);
+    if (conf->cache_use_stale & NGX_HTTP_AUTH_BASIC_LDAP_STALE_OFF) conf->cache_use_stale = NGX_CONF_BITMASK_SET|NGX_HTTP_AUTH_BASIC_LDAP_STALE_OFF;
+    if (conf->servers == NGX_CONF_UNSET_PTR) { conf->servers = prev->servers == NGX_CONF_UNSET_PTR ? NULL : prev->servers; conf->max_fails = prev->max_fails; conf->fail_timeout = prev->fail_timeout; }
+    if (conf->fail_limit == NGX_CONF_UNSET_PTR) { conf->fail_limit = prev->fail_limit == NGX_CONF_UNSET_PTR ? NULL : prev->fail_limit; conf->fail_rate = prev->fail_rate; conf->fail_burst = prev->fail_burst; conf->fail_status = prev->fail_status; }
+    ngx_conf_merge_ptr_value(conf->require, prev->require, NULL);
+    ngx_conf_merge_value(conf->nested_groups, prev->nested_groups, 0);
+    if (conf->require && !conf->nested_groups && conf->lud && conf->lud->lud_attrs) {
+        char **attr;
+        for (attr = conf->lud->lud_attrs; *attr; attr++) if (!ngx_strcasecmp((u_char *)*attr, (u_char *)"memberOf") || !ngx_strcmp(*attr, "*")) break;
+        if (!*attr) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"auth_basic_ldap_require\" requires \"memberOf\" attribute in \"auth_basic_ldap_url\""); return NGX_CONF_ERROR; }
+    }
+    if (conf->status && !conf->servers) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"auth_basic_ldap_status\" requires \"auth_basic_ldap_servers\" zone"); return NGX_CONF_ERROR; }
+#if (NGX_SSL)
+    ngx_conf_merge_str_value(conf->ssl_name, prev->ssl_name, "");
+    ngx_conf_merge_str_value(conf->ssl_trusted_certificate, prev->ssl_trusted_certificate, "");
+    ngx_conf_merge_value(conf->ssl_server_name, prev->ssl_server_name, 0);
+    ngx_conf_merge_value(conf->ssl_session_reuse, prev->ssl_session_reuse, 1);
+    ngx_conf_merge_value(conf->ssl_verify, prev->ssl_verify, 1);
+    ngx_conf_merge_uint_value(conf->ssl_verify_depth, prev->ssl_verify_depth, 1);
+    ngx_conf_merge_value(conf->starttls, prev->starttls, 0);
+    if ((rv = ngx_http_auth_basic_ldap_ssl_compile(cf, conf, prev)) != NGX_CONF_OK) return rv;
+#endif
+    return ngx_http_auth_basic_ldap_sync_compile(cf, conf);
+}
+
+static ngx_int_t ngx_http_auth_basic_ldap_init_process(ngx_cycle_t *cycle) {
+    if ((ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) || ngx_worker) return NGX_OK;
+    ngx_http_auth_basic_ldap_main_conf_t *main_conf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_auth_basic_ldap_module);
+    if (!main_conf) return NGX_OK;
+    ngx_http_auth_basic_ldap_sync_t **syncs = main_conf->syncs.elts;
+    for (ngx_uint_t i = 0; i < main_conf->syncs.nelts; i++) {
+        syncs[i]->event.handler = ngx_http_auth_basic_ldap_sync_handler;
+        syncs[i]->event.data = syncs[i];
+        syncs[i]->event.log = cycle->log;
+        syncs[i]->event.cancelable = 1;
+        ngx_http_auth_basic_ldap_sync_connect(&syncs[i]->event);
+    }
+    return NGX_OK;
 }
 
 static ngx_http_module_t ngx_http_auth_basic_ldap_ctx = {
-    .preconfiguration = NULL,
+    .preconfiguration = ngx_http_auth_basic_ldap_preconfiguration,
     .postconfiguration = ngx_http_auth_basic_ldap_postconfiguration,
-    .create_main_conf = NULL,
-    .init_main_conf = NULL,
+    .create_main_conf = ngx_http_auth_basic_ldap_create_main_conf,
+    .init_main_conf = ngx_http_auth_basic_ldap_init_main_conf,
     .create_srv_conf = NULL,
     .merge_srv_conf = NULL,
     .create_loc_conf = ngx_http_auth_basic_ldap_create_loc_conf,
@@ -404,7 +3649,7 @@ ngx_module_t ngx_http_auth_basic_ldap_module = {
     .type = NGX_HTTP_MODULE,
     .init_master = NULL,
     .init_module = NULL,
-    .init_process = NULL,
+    .init_process = ngx_http_auth_basic_ldap_init_process,
     .init_thread = NULL,
     .exit_thread = NULL,
     .exit_process = NULL,
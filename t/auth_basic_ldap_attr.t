@@ -0,0 +1,140 @@
+#!/usr/bin/perl
+
+# Tests for $ldap_attr_* variables and auth_basic_ldap_headers.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+
+use MIME::Base64;
+
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+use LDAPMock qw/ ldap_daemon ldap_ops /;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(14)
+	->write_file_expand('nginx.conf', <<'EOF');
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+}
+
+http {
+    %%TEST_GLOBALS_HTTP%%
+
+    server {
+        listen       127.0.0.1:8080;
+        server_name  localhost;
+
+        root %%TESTDIR%%;
+
+        auth_basic_ldap_url "ldap://127.0.0.1:8081/dc=test?mail,memberOf,employee-id?sub?(uid=$remote_user)";
+        auth_basic_ldap_bind uid=$remote_user,dc=test;
+
+        add_header X-Mail $ldap_attr_mail always;
+        add_header X-Groups $ldap_attr_memberof_all always;
+        add_header X-Id $ldap_attr_employee_id always;
+        add_header X-Missing "[$ldap_attr_missing]" always;
+        add_header X-Header "[$http_mail][$http_ldap_mail]" always;
+        add_header X-Group "[$http_ldap_memberof]" always;
+
+        location / {
+        }
+
+        location /separator/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_attr_separator ",";
+        }
+
+        location /headers/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_headers on;
+            auth_basic_ldap_header LDAP-;
+            auth_basic_ldap_attr memberOf "^cn=(\w+),ou=groups,dc=test$" $1;
+        }
+
+        location /noprefix/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_headers on;
+        }
+
+        location /cached/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_cache zone=ldap:1m valid=1h;
+        }
+    }
+}
+
+EOF
+
+$t->write_file('index.html', 'SEE-THIS');
+$t->run_daemon(\&ldap_daemon, '127.0.0.1:' . port(8081), $t->testdir(), {
+	'uid=alice,dc=test' => {
+		uid => [ 'alice' ],
+		userPassword => [ 'secret' ],
+		mail => [ 'alice@test' ],
+		'employee-id' => [ '42' ],
+		memberOf => [ 'cn=admins,ou=groups,dc=test', 'cn=other,dc=test' ],
+	},
+});
+$t->run()->waitforsocket('127.0.0.1:' . port(8081));
+
+###############################################################################
+
+my $r = get('/', 'alice', 'secret');
+like($r, qr/^X-Mail: alice\@test\x0d?$/m, 'first value');
+like($r, qr/^X-Groups: cn=admins,ou=groups,dc=test; cn=other,dc=test\x0d?$/m,
+	'all values');
+like($r, qr/^X-Id: 42\x0d?$/m, 'underscore matches hyphen');
+like($r, qr/^X-Missing: \[\]\x0d?$/m, 'missing attribute');
+like($r, qr/^X-Header: \[\]\[\]\x0d?$/m, 'no headers by default');
+
+unlike(get('/', 'alice', 'wrong'), qr/^X-Mail/m, 'not authenticated');
+
+like(get('/separator/', 'alice', 'secret'),
+	qr/^X-Groups: cn=admins,ou=groups,dc=test,cn=other,dc=test\x0d?$/m,
+	'separator');
+
+$r = get('/headers/', 'alice', 'secret');
+like($r, qr/^X-Header: \[\]\[alice\@test\]\x0d?$/m, 'headers with prefix');
+like($r, qr/^X-Group: \[admins\]\x0d?$/m, 'header changed by regex');
+
+like(get('/noprefix/', 'alice', 'secret'),
+	qr/^X-Header: \[alice\@test\]\[\]\x0d?$/m, 'headers without prefix');
+
+like(get('/cached/', 'alice', 'secret'), qr/^X-Mail: alice\@test\x0d?$/m,
+	'cached miss');
+my $binds = ldap_ops($t, 'bind');
+$r = get('/cached/', 'alice', 'secret');
+like($r, qr/^X-Mail: alice\@test\x0d?$/m, 'cached hit');
+like($r, qr/^X-Groups: cn=admins,ou=groups,dc=test; cn=other,dc=test\x0d?$/m,
+	'cached hit all values');
+is(ldap_ops($t, 'bind'), $binds, 'cached hit not bound');
+
+###############################################################################
+
+sub get {
+	my ($uri, $user, $password) = @_;
+	my $auth = encode_base64("$user:$password", '');
+	return http(<<EOF);
+GET $uri HTTP/1.0
+Host: localhost
+Authorization: Basic $auth
+
+EOF
+}
+
+###############################################################################
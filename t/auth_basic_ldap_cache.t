@@ -0,0 +1,109 @@
+#!/usr/bin/perl
+
+# Tests for auth_basic_ldap_cache.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+
+use MIME::Base64;
+
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+use LDAPMock qw/ ldap_daemon ldap_ops /;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(11)
+	->write_file_expand('nginx.conf', <<'EOF');
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+}
+
+http {
+    %%TEST_GLOBALS_HTTP%%
+
+    auth_basic_ldap_cache zone=ldap:1m valid=1h;
+
+    server {
+        listen       127.0.0.1:8080;
+        server_name  localhost;
+
+        root %%TESTDIR%%;
+
+        auth_basic_ldap_url "ldap://127.0.0.1:8081/dc=test?mail?sub?(uid=$remote_user)";
+        auth_basic_ldap_bind uid=$remote_user,dc=test;
+
+        add_header X-Cache $auth_basic_ldap_cache_status always;
+        add_header X-Mail $ldap_attr_mail always;
+
+        location / {
+        }
+
+        location /off/ {
+            auth_basic_ldap_cache off;
+            alias %%TESTDIR%%/;
+        }
+    }
+}
+
+EOF
+
+$t->write_file('index.html', 'SEE-THIS');
+$t->run_daemon(\&ldap_daemon, '127.0.0.1:' . port(8081), $t->testdir(), {
+	'uid=alice,dc=test' => {
+		objectClass => [ 'person' ],
+		uid => [ 'alice' ],
+		userPassword => [ 'secret' ],
+		mail => [ 'alice@test' ],
+	},
+});
+$t->run()->waitforsocket('127.0.0.1:' . port(8081));
+
+###############################################################################
+
+my $r = get('/', 'alice', 'secret');
+like($r, qr/^HTTP\/1.1 200 .*X-Cache: MISS/ms, 'miss');
+like($r, qr/X-Mail: alice\@test/, 'miss attribute');
+is(ldap_ops($t, 'bind'), 1, 'miss bind');
+
+$r = get('/', 'alice', 'secret');
+like($r, qr/^HTTP\/1.1 200 .*X-Cache: HIT/ms, 'hit');
+like($r, qr/X-Mail: alice\@test/, 'hit attribute');
+is(ldap_ops($t, 'bind'), 1, 'hit no bind');
+
+like(get('/', 'alice', 'wrong'), qr/^HTTP\/1.1 401 .*X-Cache: MISS/ms,
+	'other password');
+like(get('/', 'alice', 'wrong'), qr/^HTTP\/1.1 401 .*X-Cache: MISS/ms,
+	'invalid not cached');
+is(ldap_ops($t, 'bind'), 3, 'invalid bind');
+
+like(get('/off/', 'alice', 'secret'), qr/^HTTP\/1.1 200 /, 'cache off');
+is(ldap_ops($t, 'bind'), 4, 'cache off bind');
+
+###############################################################################
+
+sub get {
+	my ($uri, $user, $password) = @_;
+	my $auth = encode_base64("$user:$password", '');
+	return http(<<EOF);
+GET $uri HTTP/1.0
+Host: localhost
+Authorization: Basic $auth
+
+EOF
+}
+
+###############################################################################
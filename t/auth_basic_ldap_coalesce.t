@@ -0,0 +1,105 @@
+#!/usr/bin/perl
+
+# Tests for auth_basic_ldap_coalesce.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+
+use MIME::Base64;
+
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+use LDAPMock qw/ ldap_daemon ldap_ops ldap_mode /;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(8)
+	->write_file_expand('nginx.conf', <<'EOF');
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+}
+
+http {
+    %%TEST_GLOBALS_HTTP%%
+
+    server {
+        listen       127.0.0.1:8080;
+        server_name  localhost;
+
+        root %%TESTDIR%%;
+
+        auth_basic_ldap_url "ldap://127.0.0.1:8081/dc=test?mail?sub?(uid=$remote_user)";
+        auth_basic_ldap_bind uid=$remote_user,dc=test;
+        auth_basic_ldap_coalesce on;
+
+        add_header X-Mail $ldap_attr_mail always;
+
+        location / {
+        }
+    }
+}
+
+EOF
+
+$t->write_file('index.html', 'SEE-THIS');
+$t->run_daemon(\&ldap_daemon, '127.0.0.1:' . port(8081), $t->testdir(), {
+	'uid=alice,dc=test' => {
+		objectClass => [ 'person' ],
+		uid => [ 'alice' ],
+		userPassword => [ 'secret' ],
+		mail => [ 'alice@test' ],
+	},
+});
+$t->run()->waitforsocket('127.0.0.1:' . port(8081));
+
+###############################################################################
+
+ldap_mode($t, 'delay 1');
+
+# concurrent requests with the same credentials share one bind
+
+my @s = map { get('alice', 'secret', start => 1) } 1 .. 3;
+my @r = map { http_end($_) } @s;
+
+like($r[0], qr/^HTTP\/1.1 200 .*X-Mail: alice\@test/ms, 'leader');
+like($r[1], qr/^HTTP\/1.1 200 .*X-Mail: alice\@test/ms, 'follower');
+like($r[2], qr/^HTTP\/1.1 200 .*X-Mail: alice\@test/ms, 'follower 2');
+is(ldap_ops($t, 'bind'), 1, 'coalesced bind');
+
+# failed result is shared as well, other password is not coalesced
+
+@s = map { get('alice', $_, start => 1) } qw/ wrong wrong secret /;
+@r = map { http_end($_) } @s;
+
+like($r[0], qr/^HTTP\/1.1 401 /, 'invalid leader');
+like($r[1], qr/^HTTP\/1.1 401 /, 'invalid follower');
+like($r[2], qr/^HTTP\/1.1 200 /, 'other password');
+is(ldap_ops($t, 'bind'), 3, 'not coalesced bind');
+
+###############################################################################
+
+sub get {
+	my ($user, $password, %extra) = @_;
+	my $auth = encode_base64("$user:$password", '');
+	return http(<<EOF, %extra);
+GET / HTTP/1.0
+Host: localhost
+Authorization: Basic $auth
+
+EOF
+}
+
+###############################################################################
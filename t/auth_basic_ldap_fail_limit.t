@@ -0,0 +1,117 @@
+#!/usr/bin/perl
+
+# Tests for auth_basic_ldap_fail_limit.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+
+use MIME::Base64;
+
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+use LDAPMock qw/ ldap_daemon ldap_ops /;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(9)
+	->write_file_expand('nginx.conf', <<'EOF');
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+}
+
+http {
+    %%TEST_GLOBALS_HTTP%%
+
+    auth_basic_ldap_cache zone=ldap:1m valid=1h;
+
+    server {
+        listen       127.0.0.1:8080;
+        server_name  localhost;
+
+        root %%TESTDIR%%;
+
+        auth_basic_ldap_url "ldap://127.0.0.1:8081/dc=test?mail?sub?(uid=$remote_user)";
+        auth_basic_ldap_bind uid=$remote_user,dc=test;
+
+        add_header X-Cache $auth_basic_ldap_cache_status always;
+
+        location / {
+            auth_basic_ldap_fail_limit zone=fail:1m rate=1r/m burst=2
+                                       status=429;
+        }
+
+        location /unauthorized/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_fail_limit zone=fail burst=1;
+        }
+    }
+}
+
+EOF
+
+$t->write_file('index.html', 'SEE-THIS');
+$t->run_daemon(\&ldap_daemon, '127.0.0.1:' . port(8081), $t->testdir(), {
+	'uid=alice,dc=test' => {
+		objectClass => [ 'person' ],
+		uid => [ 'alice' ],
+		userPassword => [ 'secret' ],
+		mail => [ 'alice@test' ],
+	},
+	'uid=bob,dc=test' => {
+		objectClass => [ 'person' ],
+		uid => [ 'bob' ],
+		userPassword => [ 'secret' ],
+		mail => [ 'bob@test' ],
+	},
+});
+$t->run()->waitforsocket('127.0.0.1:' . port(8081));
+
+###############################################################################
+
+like(get('/', 'alice', 'secret'), qr/^HTTP\/1.1 200 .*X-Cache: MISS/ms,
+	'valid credentials cached');
+
+# failures up to burst are checked by LDAP server
+
+my @r = map { get('/', 'alice', "wrong$_") } 1 .. 3;
+is(scalar grep({ /^HTTP\/1.1 401 /ms } @r), 3, 'failures within burst');
+is(ldap_ops($t, 'bind'), 4, 'failures within burst bound');
+
+like(get('/', 'alice', 'wrong4'), qr/^HTTP\/1.1 429 /, 'user limited');
+is(ldap_ops($t, 'bind'), 4, 'limited not bound');
+
+like(get('/', 'alice', 'secret'), qr/^HTTP\/1.1 200 .*X-Cache: HIT/ms,
+	'cached credentials not locked');
+like(get('/', 'bob', 'secret'), qr/^HTTP\/1.1 429 /, 'address limited');
+
+like(get('/unauthorized/', 'bob', 'secret'), qr/^HTTP\/1.1 401 /,
+	'default status');
+is(ldap_ops($t, 'bind'), 4, 'default status not bound');
+
+###############################################################################
+
+sub get {
+	my ($uri, $user, $password) = @_;
+	my $auth = encode_base64("$user:$password", '');
+	return http(<<EOF);
+GET $uri HTTP/1.0
+Host: localhost
+Authorization: Basic $auth
+
+EOF
+}
+
+###############################################################################
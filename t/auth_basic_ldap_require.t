@@ -0,0 +1,137 @@
+#!/usr/bin/perl
+
+# Tests for auth_basic_ldap_require and auth_basic_ldap_nested_groups.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+
+use MIME::Base64;
+
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+use LDAPMock qw/ ldap_daemon ldap_ops /;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(11)
+	->write_file_expand('nginx.conf', <<'EOF');
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+}
+
+http {
+    %%TEST_GLOBALS_HTTP%%
+
+    server {
+        listen       127.0.0.1:8080;
+        server_name  localhost;
+
+        root %%TESTDIR%%;
+
+        auth_basic_ldap_url "ldap://127.0.0.1:8081/dc=test?memberOf?sub?(uid=$remote_user)";
+        auth_basic_ldap_bind uid=$remote_user,dc=test;
+
+        location /direct/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_require group "cn=admins,dc=test"
+                                          "cn=developers,dc=test";
+        }
+
+        location /both/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_require group "cn=admins,dc=test";
+            auth_basic_ldap_require group "cn=developers,dc=test";
+        }
+
+        location /nested/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_url "ldap://127.0.0.1:8081/dc=test?mail?sub?(uid=$remote_user)";
+            auth_basic_ldap_require group "cn=admins,dc=test";
+            auth_basic_ldap_nested_groups on;
+        }
+    }
+}
+
+EOF
+
+$t->write_file('index.html', 'SEE-THIS');
+$t->run_daemon(\&ldap_daemon, '127.0.0.1:' . port(8081), $t->testdir(), {
+	'uid=alice,dc=test' => {
+		uid => [ 'alice' ],
+		userPassword => [ 'secret' ],
+		memberOf => [ 'cn=admins,dc=test', 'cn=developers,dc=test' ],
+	},
+	'uid=bob,dc=test' => {
+		uid => [ 'bob' ],
+		userPassword => [ 'secret' ],
+		memberOf => [ 'cn=developers,dc=test' ],
+	},
+	'uid=carol,dc=test' => {
+		uid => [ 'carol' ],
+		userPassword => [ 'secret' ],
+		memberOf => [ 'cn=ops,dc=test' ],
+	},
+	'cn=admins,dc=test' => {
+		member => [ 'uid=alice,dc=test', 'cn=ops,dc=test' ],
+	},
+	'cn=developers,dc=test' => {
+		member => [ 'uid=alice,dc=test', 'uid=bob,dc=test' ],
+	},
+	'cn=ops,dc=test' => {
+		member => [ 'uid=carol,dc=test' ],
+	},
+});
+$t->run()->waitforsocket('127.0.0.1:' . port(8081));
+
+###############################################################################
+
+like(get('/direct/', 'alice', 'secret'), qr/^HTTP\/1.1 200 /, 'member');
+like(get('/direct/', 'bob', 'secret'), qr/^HTTP\/1.1 200 /, 'member of any');
+like(get('/direct/', 'carol', 'secret'), qr/^HTTP\/1.1 403 /, 'not member');
+like(get('/direct/', 'carol', 'wrong'), qr/^HTTP\/1.1 401 /,
+	'invalid password');
+
+like(get('/both/', 'alice', 'secret'), qr/^HTTP\/1.1 200 /, 'member of all');
+like(get('/both/', 'bob', 'secret'), qr/^HTTP\/1.1 403 /, 'not member of all');
+
+my $searches = ldap_ops($t, 'search');
+
+like(get('/nested/', 'alice', 'secret'), qr/^HTTP\/1.1 200 /,
+	'nested direct member');
+like(get('/nested/', 'carol', 'secret'), qr/^HTTP\/1.1 200 /,
+	'nested member');
+like(get('/nested/', 'bob', 'secret'), qr/^HTTP\/1.1 403 /,
+	'nested not member');
+is(ldap_ops($t, 'search') - $searches, 6, 'nested groups searched');
+
+$t->stop();
+
+unlike($t->read_file('error.log'), qr/\[error\]/, 'no errors');
+
+###############################################################################
+
+sub get {
+	my ($uri, $user, $password) = @_;
+	my $auth = encode_base64("$user:$password", '');
+	return http(<<EOF);
+GET $uri HTTP/1.0
+Host: localhost
+Authorization: Basic $auth
+
+EOF
+}
+
+###############################################################################
@@ -0,0 +1,145 @@
+#!/usr/bin/perl
+
+# Tests for failover between addresses of LDAP server and
+# auth_basic_ldap_servers.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+
+use IO::Socket::INET;
+
+use MIME::Base64;
+
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+use LDAPMock qw/ ldap_daemon dns_daemon ldap_ops ldap_mode /;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+plan(skip_all => '127.0.0.2 local address required')
+	unless defined IO::Socket::INET->new(LocalAddr => '127.0.0.2');
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(11)
+	->write_file_expand('nginx.conf', <<'EOF');
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+}
+
+http {
+    %%TEST_GLOBALS_HTTP%%
+
+    resolver 127.0.0.1:%%PORT_8982_UDP%% ipv6=off;
+
+    server {
+        listen       127.0.0.1:8080;
+        server_name  localhost;
+
+        root %%TESTDIR%%;
+
+        auth_basic_ldap_url "ldap://ldap.test:%%PORT_8081%%/dc=test?mail?sub?(uid=$remote_user)";
+        auth_basic_ldap_bind uid=$remote_user,dc=test;
+        auth_basic_ldap_connect_timeout 1s;
+
+        auth_basic_ldap_servers zone=ldap_servers:1m fail_timeout=1h;
+
+        add_header X-Server $auth_basic_ldap_server always;
+
+        location / {
+            auth_basic_ldap_servers off;
+        }
+
+        location /servers/ {
+            alias %%TESTDIR%%/;
+        }
+
+        location = /status {
+            auth_basic_ldap_realm off;
+            auth_basic_ldap_status json;
+        }
+    }
+}
+
+EOF
+
+$t->write_file('index.html', 'SEE-THIS');
+
+# the name resolves to both addresses, but only the second one listens
+
+$t->run_daemon(\&dns_daemon, port(8982), $t->testdir(),
+	'127.0.0.1', '127.0.0.2');
+$t->run_daemon(\&ldap_daemon, '127.0.0.2:' . port(8081), $t->testdir(), {
+	'uid=alice,dc=test' => {
+		objectClass => [ 'person' ],
+		uid => [ 'alice' ],
+		userPassword => [ 'secret' ],
+		mail => [ 'alice@test' ],
+	},
+});
+$t->run();
+$t->waitforfile($t->testdir . '/' . port(8982));
+$t->waitforsocket('127.0.0.2:' . port(8081));
+
+###############################################################################
+
+my $server = qr/X-Server: 127.0.0.2:${\ port(8081)}/;
+
+like(get('/', 'alice', 'secret'), qr/^HTTP\/1.1 200 .*$server/ms, 'failover');
+like(get('/', 'alice', 'secret'), qr/^HTTP\/1.1 200 .*$server/ms,
+	'failover 2');
+like(get('/', 'alice', 'wrong'), qr/^HTTP\/1.1 401 .*$server/ms,
+	'failover invalid');
+
+# failed address is tried at most once while it is down in the zone
+
+like(get('/servers/', 'alice', 'secret'), qr/^HTTP\/1.1 200 .*$server/ms,
+	'servers');
+like(get('/servers/', 'alice', 'secret'), qr/^HTTP\/1.1 200 .*$server/ms,
+	'servers 2');
+like(get('/servers/', 'alice', 'secret'), qr/^HTTP\/1.1 200 .*$server/ms,
+	'servers 3');
+
+my $status = http_get('/status');
+my $port = port(8081);
+like($status, qr/"127.0.0.2:$port":\{"outstanding":0,"fails":0,/,
+	'status up');
+unlike($status, qr/"127.0.0.1:$port":\{[^{]*"failures":([2-9]|\d\d)/,
+	'status down skipped');
+
+# busy and lost connections are retried on the next address
+
+ldap_mode($t, 'busy');
+like(get('/', 'alice', 'secret'), qr/^HTTP\/1.1 500 /, 'busy');
+
+ldap_mode($t, 'down');
+like(get('/', 'alice', 'secret'), qr/^HTTP\/1.1 500 /, 'down');
+
+ldap_mode($t, '');
+like(get('/', 'alice', 'secret'), qr/^HTTP\/1.1 200 .*$server/ms, 'up');
+
+###############################################################################
+
+sub get {
+	my ($uri, $user, $password) = @_;
+	my $auth = encode_base64("$user:$password", '');
+	return http(<<EOF);
+GET $uri HTTP/1.0
+Host: localhost
+Authorization: Basic $auth
+
+EOF
+}
+
+###############################################################################
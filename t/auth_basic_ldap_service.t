@@ -0,0 +1,111 @@
+#!/usr/bin/perl
+
+# Tests for auth_basic_ldap_service_bind.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+
+use MIME::Base64;
+
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+use LDAPMock qw/ ldap_daemon ldap_ops ldap_mode /;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(7)
+	->write_file_expand('nginx.conf', <<'EOF');
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+}
+
+http {
+    %%TEST_GLOBALS_HTTP%%
+
+    large_client_header_buffers 4 64k;
+
+    server {
+        listen       127.0.0.1:8080;
+        server_name  localhost;
+
+        root %%TESTDIR%%;
+
+        auth_basic_ldap_url "ldap://127.0.0.1:8081/dc=test?mail?sub?(uid=$remote_user)";
+        auth_basic_ldap_service_bind cn=nginx,dc=test password;
+        auth_basic_ldap_search_timeout 60s;
+
+        add_header X-Mail $ldap_attr_mail always;
+
+        location / {
+        }
+    }
+}
+
+EOF
+
+$t->write_file('index.html', 'SEE-THIS');
+$t->run_daemon(\&ldap_daemon, '127.0.0.1:' . port(8081), $t->testdir(), {
+	'cn=nginx,dc=test' => {
+		objectClass => [ 'person' ],
+		userPassword => [ 'password' ],
+	},
+	'uid=alice,dc=test' => {
+		objectClass => [ 'person' ],
+		uid => [ 'alice' ],
+		userPassword => [ 'secret' ],
+		mail => [ 'alice@test' ],
+	},
+});
+$t->run()->waitforsocket('127.0.0.1:' . port(8081));
+
+###############################################################################
+
+like(get('alice', 'secret'), qr/^HTTP\/1.1 200 .*X-Mail: alice\@test/ms,
+	'search and bind');
+like(get('alice', 'wrong'), qr/^HTTP\/1.1 401 /, 'invalid password');
+like(get('bob', 'secret'), qr/^HTTP\/1.1 401 /, 'user not found');
+is(ldap_ops($t, 'bind'), 3, 'service connection bound once');
+
+# searches pipelined on the service connection while LDAP server does not
+# read them fill socket buffer and must be sent as soon as it is writable
+
+ldap_mode($t, 'stall 3');
+
+my @s = map { get('x' x 32768 . $_, 'secret', start => 1) } 1 .. 200;
+my $s = get('alice', 'secret', start => 1);
+
+my @r = map { http_end($_) // '' } @s;
+is(scalar grep({ /^HTTP\/1.1 401 /ms } @r), 200, 'pipelined searches');
+like(http_end($s) // '', qr/^HTTP\/1.1 200 /, 'pipelined search after');
+
+$t->stop();
+
+unlike($t->read_file('error.log'), qr/timed out/, 'no timeouts');
+
+###############################################################################
+
+sub get {
+	my ($user, $password, %extra) = @_;
+	my $auth = encode_base64("$user:$password", '');
+	return http(<<EOF, %extra);
+GET / HTTP/1.0
+Host: localhost
+Authorization: Basic $auth
+
+EOF
+}
+
+###############################################################################
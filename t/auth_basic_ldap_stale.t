@@ -0,0 +1,144 @@
+#!/usr/bin/perl
+
+# Tests for auth_basic_ldap_cache_use_stale and
+# auth_basic_ldap_cache_background_update.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+
+use MIME::Base64;
+
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+use LDAPMock qw/ ldap_daemon ldap_ops ldap_mode /;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(13)
+	->write_file_expand('nginx.conf', <<'EOF');
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+}
+
+http {
+    %%TEST_GLOBALS_HTTP%%
+
+    server {
+        listen       127.0.0.1:8080;
+        server_name  localhost;
+
+        root %%TESTDIR%%;
+
+        auth_basic_ldap_url "ldap://127.0.0.1:8081/dc=test?mail?sub?(uid=$remote_user)";
+        auth_basic_ldap_bind uid=$remote_user,dc=test;
+
+        add_header X-Cache $auth_basic_ldap_cache_status always;
+
+        location /error/ {
+            auth_basic_ldap_cache zone=ldap:1m valid=1s stale=1h;
+            auth_basic_ldap_cache_use_stale error;
+            alias %%TESTDIR%%/;
+        }
+
+        location /updating/ {
+            auth_basic_ldap_cache zone=ldap:1m valid=1s stale=1h;
+            auth_basic_ldap_cache_use_stale updating;
+            auth_basic_ldap_cache_background_update on;
+            alias %%TESTDIR%%/;
+        }
+    }
+}
+
+EOF
+
+$t->write_file('index.html', 'SEE-THIS');
+$t->run_daemon(\&ldap_daemon, '127.0.0.1:' . port(8081), $t->testdir(), {
+	map { ("uid=$_,dc=test" => {
+		objectClass => [ 'person' ],
+		uid => [ $_ ],
+		userPassword => [ 'secret' ],
+		mail => [ "$_\@test" ],
+	}) } qw/ alice bob carol /
+});
+$t->run()->waitforsocket('127.0.0.1:' . port(8081));
+
+###############################################################################
+
+# expired result is used when LDAP server fails
+
+like(get('/error/', 'alice'), qr/^HTTP\/1.1 200 .*X-Cache: MISS/ms, 'miss');
+
+ldap_mode($t, 'down');
+sleep 2;
+
+like(get('/error/', 'alice'), qr/^HTTP\/1.1 200 .*X-Cache: STALE/ms,
+	'stale on error');
+like(get('/error/', 'carol'), qr/^HTTP\/1.1 500 /, 'error not cached');
+
+ldap_mode($t, '');
+
+like(get('/error/', 'alice'), qr/^HTTP\/1.1 200 .*X-Cache: EXPIRED/ms,
+	'expired updated');
+like(get('/error/', 'alice'), qr/^HTTP\/1.1 200 .*X-Cache: HIT/ms,
+	'hit after update');
+
+# expired result is answered while it is updated in background
+
+like(get('/updating/', 'bob'), qr/^HTTP\/1.1 200 .*X-Cache: MISS/ms,
+	'updating miss');
+
+sleep 2;
+my $binds = ldap_ops($t, 'bind');
+
+like(get('/updating/', 'bob'), qr/^HTTP\/1.1 200 .*X-Cache: UPDATING/ms,
+	'updating');
+is(ldap_ops($t, 'bind'), $binds + 1, 'background bind');
+like(get('/updating/', 'bob'), qr/^HTTP\/1.1 200 .*X-Cache: HIT/ms,
+	'hit after background update');
+
+# failed background update keeps expired result until update lock expires
+
+sleep 2;
+ldap_mode($t, 'busy');
+
+like(get('/updating/', 'bob'), qr/^HTTP\/1.1 200 .*X-Cache: UPDATING/ms,
+	'updating busy');
+
+ldap_mode($t, '');
+$binds = ldap_ops($t, 'bind');
+
+like(get('/updating/', 'bob'), qr/^HTTP\/1.1 200 .*X-Cache: UPDATING/ms,
+	'expired kept');
+is(ldap_ops($t, 'bind'), $binds, 'update locked');
+
+$t->stop();
+
+unlike($t->read_file('error.log'), qr/\[alert\]/, 'no alerts');
+
+###############################################################################
+
+sub get {
+	my ($uri, $user) = @_;
+	my $auth = encode_base64("$user:secret", '');
+	return http(<<EOF);
+GET $uri HTTP/1.0
+Host: localhost
+Authorization: Basic $auth
+
+EOF
+}
+
+###############################################################################
@@ -0,0 +1,111 @@
+#!/usr/bin/perl
+
+# Tests for auth_basic_ldap_status.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+
+use MIME::Base64;
+
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+use LDAPMock qw/ ldap_daemon /;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(7)
+	->write_file_expand('nginx.conf', <<'EOF');
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+}
+
+http {
+    %%TEST_GLOBALS_HTTP%%
+
+    server {
+        listen       127.0.0.1:8080;
+        server_name  localhost;
+
+        root %%TESTDIR%%;
+
+        auth_basic_ldap_url "ldap://127.0.0.1:8081/dc=test?mail?sub?(uid=$remote_user)";
+        auth_basic_ldap_bind uid=$remote_user,dc=test;
+        auth_basic_ldap_servers zone=ldap_servers:1m;
+
+        location / {
+        }
+
+        location = /json {
+            auth_basic_ldap_realm off;
+            auth_basic_ldap_status json;
+        }
+
+        location = /prometheus {
+            auth_basic_ldap_realm off;
+            auth_basic_ldap_status prometheus;
+        }
+    }
+}
+
+EOF
+
+$t->write_file('index.html', 'SEE-THIS');
+$t->run_daemon(\&ldap_daemon, '127.0.0.1:' . port(8081), $t->testdir(), {
+	'uid=alice,dc=test' => {
+		objectClass => [ 'person' ],
+		uid => [ 'alice' ],
+		userPassword => [ 'secret' ],
+		mail => [ 'alice@test' ],
+	},
+});
+$t->run()->waitforsocket('127.0.0.1:' . port(8081));
+
+###############################################################################
+
+my $server = '127.0.0.1:' . port(8081);
+
+# single address of LDAP server is accounted as well
+
+like(get('alice', 'secret'), qr/^HTTP\/1.1 200 /, 'success');
+like(get('alice', 'wrong'), qr/^HTTP\/1.1 401 /, 'invalid');
+
+my $json = http_get('/json');
+like($json, qr/"\Q$server\E":\{"outstanding":0,"fails":0,/, 'json server');
+like($json, qr/"\Q$server\E":\{[^{]*"bind_responses":2,/, 'json binds');
+like($json, qr/"\Q$server\E":\{[^{]*"invalid_credentials":1,/,
+	'json invalid');
+
+my $prometheus = http_get('/prometheus');
+like($prometheus,
+	qr/^auth_basic_ldap_search_results_total\{server="\Q$server\E"\} 1$/m,
+	'prometheus searches');
+like($prometheus, qr/^auth_basic_ldap_latency_seconds_count
+	\{server="\Q$server\E",phase="bind"\}\ 2$/mx, 'prometheus latency');
+
+###############################################################################
+
+sub get {
+	my ($user, $password) = @_;
+	my $auth = encode_base64("$user:$password", '');
+	return http(<<EOF);
+GET / HTTP/1.0
+Host: localhost
+Authorization: Basic $auth
+
+EOF
+}
+
+###############################################################################
@@ -0,0 +1,151 @@
+#!/usr/bin/perl
+
+# Tests for auth_basic_ldap_cache_sync with persistent search.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+
+use MIME::Base64;
+
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+use LDAPMock qw/ ldap_daemon ldap_ops ldap_change /;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+my $conf = <<'EOF';
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+}
+
+http {
+    %%TEST_GLOBALS_HTTP%%
+
+    auth_basic_ldap_cache zone=ldap:1m valid=1h;
+
+    server {
+        listen       127.0.0.1:8080;
+        server_name  localhost;
+
+        root %%TESTDIR%%;
+
+        auth_basic_ldap_url "ldap://127.0.0.1:8081/dc=test?memberOf?sub?(uid=$remote_user)";
+        auth_basic_ldap_service_bind cn=nginx,dc=test password;
+        auth_basic_ldap_cache_sync "ldap://127.0.0.1:8081/dc=test?member,memberOf?sub?(objectClass=*)" mode=psearch;
+
+        add_header X-Cache $auth_basic_ldap_cache_status always;
+
+        location / {
+        }
+
+        location /admins/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_require group "cn=admins,dc=test";
+        }
+    }
+}
+
+EOF
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(12)
+	->write_file_expand('nginx.conf', $conf);
+
+$t->write_file('index.html', 'SEE-THIS');
+$t->run_daemon(\&ldap_daemon, '127.0.0.1:' . port(8081), $t->testdir(), {
+	'cn=nginx,dc=test' => {
+		userPassword => [ 'password' ],
+	},
+	'uid=alice,dc=test' => {
+		uid => [ 'alice' ],
+		userPassword => [ 'secret' ],
+		memberOf => [ 'cn=admins,dc=test' ],
+	},
+	'uid=bob,dc=test' => {
+		uid => [ 'bob' ],
+		userPassword => [ 'secret' ],
+	},
+	'uid=carol,dc=test' => {
+		uid => [ 'carol' ],
+		userPassword => [ 'secret' ],
+	},
+	'cn=admins,dc=test' => {
+		member => [ 'uid=alice,dc=test' ],
+	},
+});
+$t->run()->waitforsocket('127.0.0.1:' . port(8081));
+
+# persistent search is started by worker process on its start
+
+for (1 .. 50) {
+	last if ldap_ops($t, 'search');
+	select undef, undef, undef, 0.1;
+}
+
+###############################################################################
+
+like(get('/admins/', 'alice', 'secret'), qr/^HTTP\/1.1 200 /, 'group member');
+like(get('/admins/', 'alice', 'secret'), qr/X-Cache: HIT/, 'group cached');
+like(get('/admins/', 'bob', 'secret'), qr/^HTTP\/1.1 403 /, 'not member');
+
+ldap_change($t, 'cn=admins,dc=test');
+select undef, undef, undef, 1;
+
+like(get('/admins/', 'alice', 'secret'), qr/^HTTP\/1.1 200 .*X-Cache: MISS/ms,
+	'group change evicted');
+
+like(get('/', 'carol', 'secret'), qr/^HTTP\/1.1 200 /, 'user');
+like(get('/', 'carol', 'secret'), qr/X-Cache: HIT/, 'user cached');
+
+ldap_change($t, 'uid=bob,dc=test');
+select undef, undef, undef, 1;
+
+like(get('/', 'carol', 'secret'), qr/X-Cache: HIT/, 'other user change kept');
+
+ldap_change($t, 'uid=carol,dc=test');
+select undef, undef, undef, 1;
+
+like(get('/', 'carol', 'secret'), qr/^HTTP\/1.1 200 .*X-Cache: MISS/ms,
+	'user change evicted');
+like(get('/', 'carol', 'secret'), qr/X-Cache: HIT/, 'user cached again');
+
+$t->stop();
+
+is(ldap_ops($t, 'search'), 6, 'one persistent search');
+unlike($t->read_file('error.log'), qr/\[error\]/, 'no errors');
+
+# cache sync must be bound with service account
+
+$conf =~ s/^.*auth_basic_ldap_service_bind.*\n//m;
+$t->write_file_expand('nginx.conf', $conf);
+
+my $d = $t->testdir();
+like(`$Test::Nginx::NGINX -p $d/ -c nginx.conf -e error.log -t 2>&1`,
+	qr/requires "auth_basic_ldap_service_bind"/, 'service bind required');
+
+###############################################################################
+
+sub get {
+	my ($uri, $user, $password) = @_;
+	my $auth = encode_base64("$user:$password", '');
+	return http(<<EOF);
+GET $uri HTTP/1.0
+Host: localhost
+Authorization: Basic $auth
+
+EOF
+}
+
+###############################################################################
@@ -0,0 +1,150 @@
+#!/usr/bin/perl
+
+# Tests for TLS connections with LDAP server: ldaps url and
+# auth_basic_ldap_starttls.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+
+use MIME::Base64;
+
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+use LDAPMock qw/ ldap_daemon ldap_ops /;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+eval { require IO::Socket::SSL; };
+plan(skip_all => 'IO::Socket::SSL not installed') if $@;
+
+my $t = Test::Nginx->new()->has(qw/http http_ssl/)->has_daemon('openssl')
+	->plan(9)->write_file_expand('nginx.conf', <<'EOF');
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+}
+
+http {
+    %%TEST_GLOBALS_HTTP%%
+
+    server {
+        listen       127.0.0.1:8080;
+        server_name  localhost;
+
+        root %%TESTDIR%%;
+
+        auth_basic_ldap_bind uid=$remote_user,dc=test;
+        auth_basic_ldap_ssl_name localhost;
+        auth_basic_ldap_ssl_trusted_certificate localhost.crt;
+
+        add_header X-Mail $ldap_attr_mail always;
+
+        location /ldaps/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_url "ldaps://127.0.0.1:8081/dc=test?mail?sub?(uid=$remote_user)";
+        }
+
+        location /starttls/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_url "ldap://127.0.0.1:8082/dc=test?mail?sub?(uid=$remote_user)";
+            auth_basic_ldap_starttls on;
+        }
+
+        location /untrusted/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_url "ldaps://127.0.0.1:8081/dc=test?mail?sub?(uid=$remote_user)";
+            auth_basic_ldap_ssl_trusted_certificate other.crt;
+        }
+
+        location /noverify/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_url "ldaps://127.0.0.1:8081/dc=test?mail?sub?(uid=$remote_user)";
+            auth_basic_ldap_ssl_verify off;
+        }
+    }
+}
+
+EOF
+
+$t->write_file('openssl.conf', <<EOF);
+[ req ]
+default_bits = 2048
+encrypt_key = no
+distinguished_name = req_distinguished_name
+[ req_distinguished_name ]
+EOF
+
+my $d = $t->testdir();
+
+foreach my $name ('localhost', 'other') {
+	system('openssl req -x509 -new '
+		. "-config $d/openssl.conf -subj /CN=$name/ "
+		. "-out $d/$name.crt -keyout $d/$name.key "
+		. ">>$d/openssl.out 2>&1") == 0
+		or die "Can't create certificate for $name: $!\n";
+}
+
+my $entries = {
+	'uid=alice,dc=test' => {
+		uid => [ 'alice' ],
+		userPassword => [ 'secret' ],
+		mail => [ 'alice@test' ],
+	},
+};
+
+$t->write_file('index.html', 'SEE-THIS');
+$t->run_daemon(\&ldap_daemon, '127.0.0.1:' . port(8081), $d, $entries,
+	ldaps => 1, cert => "$d/localhost.crt", key => "$d/localhost.key");
+$t->run_daemon(\&ldap_daemon, '127.0.0.1:' . port(8082), $d, $entries,
+	starttls => 1, cert => "$d/localhost.crt", key => "$d/localhost.key");
+$t->run()->waitforsocket('127.0.0.1:' . port(8081));
+$t->waitforsocket('127.0.0.1:' . port(8082));
+
+###############################################################################
+
+like(get('/ldaps/', 'alice', 'secret'),
+	qr/^HTTP\/1.1 200 .*X-Mail: alice\@test/ms, 'ldaps');
+like(get('/ldaps/', 'alice', 'wrong'), qr/^HTTP\/1.1 401 /,
+	'ldaps invalid password');
+
+like(get('/starttls/', 'alice', 'secret'),
+	qr/^HTTP\/1.1 200 .*X-Mail: alice\@test/ms, 'starttls');
+like(get('/starttls/', 'alice', 'wrong'), qr/^HTTP\/1.1 401 /,
+	'starttls invalid password');
+is(ldap_ops($t, 'starttls'), 2, 'starttls requested');
+
+like(get('/untrusted/', 'alice', 'secret'), qr/^HTTP\/1.1 500 /, 'untrusted');
+like(get('/noverify/', 'alice', 'secret'), qr/^HTTP\/1.1 200 /, 'no verify');
+
+$t->stop();
+
+like($t->read_file('error.log'), qr/certificate verify error/,
+	'untrusted logged');
+is(ldap_ops($t, 'bind'), 5, 'binds over TLS');
+
+###############################################################################
+
+sub get {
+	my ($uri, $user, $password) = @_;
+	my $auth = encode_base64("$user:$password", '');
+	return http(<<EOF);
+GET $uri HTTP/1.0
+Host: localhost
+Authorization: Basic $auth
+
+EOF
+}
+
+###############################################################################
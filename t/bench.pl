@@ -0,0 +1,293 @@
+#!/usr/bin/perl
+
+# Load test of ngx_http_auth_basic_ldap_module with mock LDAP server.
+#
+# For each scenario prints number of requests, requests per second, p50 and
+# p99 latency, LDAP operations per request (taken from log of mock server)
+# and counts of response statuses:
+#   cold-storm      - all clients at once ask for the same users with empty
+#                     cache and coalescing of identical authentications
+#   steady-state    - random users with warm cache
+#   large-memberof  - user with many memberOf values checked by
+#                     auth_basic_ldap_require without cache
+#   slow-server     - LDAP server answering with delay
+#   dead-server     - name resolving to refusing and working addresses
+#
+# BENCH_CONCURRENCY clients (default 32) send requests over keepalive
+# connections during BENCH_DURATION seconds (default 5), BENCH_USERS users
+# (default 100) are in directory, BENCH_GROUPS values (default 2000) are in
+# memberOf of large user.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use IO::Socket::INET;
+use MIME::Base64;
+use Time::HiRes qw/ time sleep /;
+
+BEGIN { use FindBin; chdir($FindBin::Bin); }
+
+use lib 'lib';
+use Test::Nginx;
+use LDAPMock qw/ ldap_daemon dns_daemon /;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+my $concurrency = $ENV{BENCH_CONCURRENCY} || 32;
+my $duration = $ENV{BENCH_DURATION} || 5;
+my $users = $ENV{BENCH_USERS} || 100;
+my $groups = $ENV{BENCH_GROUPS} || 2000;
+
+my $t = Test::Nginx->new()->write_file_expand('nginx.conf', <<'EOF');
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+    worker_connections 4096;
+}
+
+http {
+    %%TEST_GLOBALS_HTTP%%
+
+    access_log off;
+    keepalive_requests 1000000;
+
+    resolver 127.0.0.1:%%PORT_8982_UDP%% ipv6=off;
+
+    auth_basic_ldap_keepalive 64;
+
+    server {
+        listen       127.0.0.1:8080 backlog=4096;
+        server_name  localhost;
+
+        root %%TESTDIR%%;
+
+        auth_basic_ldap_url "ldap://127.0.0.1:8081/dc=test?mail?sub?(uid=$remote_user)";
+        auth_basic_ldap_bind uid=$remote_user,dc=test;
+
+        location /cold/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_cache zone=cold:10m valid=1h;
+            auth_basic_ldap_coalesce on;
+        }
+
+        location /steady/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_cache zone=steady:10m valid=1h;
+        }
+
+        location /groups/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_url "ldap://127.0.0.1:8081/dc=test?memberOf?sub?(uid=$remote_user)";
+            auth_basic_ldap_require group "cn=group%%GROUP%%,ou=groups,dc=test";
+        }
+
+        location /slow/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_url "ldap://127.0.0.1:8082/dc=test?mail?sub?(uid=$remote_user)";
+        }
+
+        location /dead/ {
+            alias %%TESTDIR%%/;
+            auth_basic_ldap_url "ldap://ldap.test:%%PORT_8081%%/dc=test?mail?sub?(uid=$remote_user)";
+            auth_basic_ldap_servers zone=servers:1m max_fails=1 fail_timeout=1s;
+        }
+    }
+}
+
+EOF
+
+my $d = $t->testdir();
+
+my $conf = $t->read_file('nginx.conf');
+$conf =~ s/%%GROUP%%/$groups/;
+$t->write_file('nginx.conf', $conf);
+
+my %entries = map {
+	("uid=user$_,dc=test" => {
+		uid => [ "user$_" ],
+		userPassword => [ 'secret' ],
+		mail => [ "user$_\@test" ],
+	})
+} 1 .. $users;
+
+$entries{'uid=large,dc=test'} = {
+	uid => [ 'large' ],
+	userPassword => [ 'secret' ],
+	memberOf => [ map { "cn=group$_,ou=groups,dc=test" } 1 .. $groups ],
+};
+
+mkdir "$d/slow";
+$t->write_file('slow/ldap.mode', 'delay 0.05');
+
+$t->write_file('index.html', 'SEE-THIS');
+$t->run_daemon(\&dns_daemon, port(8982), $d, '127.0.0.2', '127.0.0.1');
+$t->run_daemon(\&ldap_daemon, '127.0.0.1:' . port(8081), $d, \%entries);
+$t->run_daemon(\&ldap_daemon, '127.0.0.1:' . port(8082), "$d/slow",
+	\%entries);
+$t->run();
+$t->waitforfile("$d/" . port(8982));
+$t->waitforsocket('127.0.0.1:' . port(8081));
+$t->waitforsocket('127.0.0.1:' . port(8082));
+
+###############################################################################
+
+my @users = map { "user$_" } 1 .. $users;
+
+my %scenarios = (
+	'cold-storm' => sub {
+		bench('/cold/', $d, requests => [ @users[0 .. 15] ]);
+	},
+	'steady-state' => sub {
+		bench('/steady/', $d, requests => \@users);
+		bench('/steady/', $d, users => \@users);
+	},
+	'large-memberof' => sub {
+		bench('/groups/', $d, users => [ 'large' ]);
+	},
+	'slow-server' => sub {
+		bench('/slow/', "$d/slow", users => \@users);
+	},
+	'dead-server' => sub {
+		bench('/dead/', $d, users => \@users);
+	},
+);
+
+my @order = qw/ cold-storm steady-state large-memberof slow-server
+	dead-server /;
+
+printf "%-16s %8s %8s %8s %8s %8s  %s\n",
+	'scenario', 'requests', 'rps', 'p50 ms', 'p99 ms', 'ops/req', 'statuses';
+
+for my $name (@ARGV ? @ARGV : @order) {
+	die "Unknown scenario \"$name\"\n" unless $scenarios{$name};
+	my $r = $scenarios{$name}->();
+	printf "%-16s %8d %8.0f %8.2f %8.2f %8.2f  %s\n", $name,
+		@$r{qw/ requests rps p50 p99 ops statuses /};
+}
+
+###############################################################################
+
+# bench($uri, $dir, requests => [ users ]) sends request of each user from
+# every client at once, bench($uri, $dir, users => [ users ]) sends requests
+# of random users during $duration seconds
+
+sub bench {
+	my ($uri, $dir, %args) = @_;
+
+	my $ops = ops($dir);
+	my $start = time() + 0.5;
+	my @pids;
+
+	for my $n (1 .. $concurrency) {
+		my $pid = fork();
+		die "Can't fork: $!\n" unless defined $pid;
+		if ($pid == 0) {
+			client($uri, "$d/bench.$n", $start, %args);
+			exit 0;
+		}
+		push @pids, $pid;
+	}
+
+	waitpid($_, 0) for @pids;
+
+	my (@latency, %statuses);
+	my $end = $start;
+
+	for my $n (1 .. $concurrency) {
+		open my $fh, '<', "$d/bench.$n" or next;
+		while (<$fh>) {
+			my ($status, $time, $done) = split;
+			push @latency, $time;
+			$statuses{$status}++;
+			$end = $done if $done > $end;
+		}
+		close $fh;
+		unlink "$d/bench.$n";
+	}
+
+	@latency = sort { $a <=> $b } @latency;
+	my $requests = @latency || 1;
+
+	return {
+		requests => scalar @latency,
+		rps => @latency / ($end - $start || 1),
+		p50 => 1000 * ($latency[int($#latency * 0.5)] // 0),
+		p99 => 1000 * ($latency[int($#latency * 0.99)] // 0),
+		ops => (ops($dir) - $ops) / $requests,
+		statuses => join(' ', map { "$_:$statuses{$_}" } sort keys %statuses),
+	};
+}
+
+sub client {
+	my ($uri, $file, $start, %args) = @_;
+
+	open my $out, '>', $file or die "Can't open $file: $!\n";
+	srand($$);
+
+	my $s;
+	my @queue = @{$args{requests} || []};
+	my $until = $start + $duration;
+
+	sleep($start - time()) if $start > time();
+
+	while ($args{requests} ? @queue : time() < $until) {
+		my $user = $args{requests} ? shift @queue
+			: $args{users}[int rand @{$args{users}}];
+		my $auth = encode_base64("$user:secret", '');
+
+		my $begin = time();
+		$s ||= IO::Socket::INET->new(
+			Proto => 'tcp',
+			PeerAddr => '127.0.0.1:' . port(8080),
+		) or die "Can't connect to nginx: $!\n";
+
+		$s->syswrite("GET $uri HTTP/1.1\x0d\x0a"
+			. "Host: localhost\x0d\x0a"
+			. "Authorization: Basic $auth\x0d\x0a\x0d\x0a");
+
+		my ($status, $close) = response($s);
+		undef $s if $close;
+		printf $out "%s %.6f %.6f\n", $status, time() - $begin, time();
+	}
+
+	close $out;
+}
+
+sub response {
+	my ($s) = @_;
+	my $buf = '';
+
+	while ($buf !~ /\x0d\x0a\x0d\x0a/) {
+		$s->sysread($buf, 65536, length $buf) or return ('error', 1);
+	}
+
+	my ($head, $body) = split /\x0d\x0a\x0d\x0a/, $buf, 2;
+	my ($status) = $head =~ /^HTTP\/1.1 (\d+)/;
+	my ($length) = $head =~ /^Content-Length: (\d+)/mi;
+	$length //= 0;
+
+	while (length $body < $length) {
+		$s->sysread($body, 65536, length $body) or return ('error', 1);
+	}
+
+	return ($status // 'error', $head =~ /^Connection: close/mi);
+}
+
+sub ops {
+	my ($dir) = @_;
+	open my $fh, '<', "$dir/ldap.log" or return 0;
+	my $n = 0;
+	$n++ while <$fh>;
+	close $fh;
+	return $n;
+}
+
+###############################################################################
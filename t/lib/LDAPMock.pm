@@ -0,0 +1,366 @@
+package LDAPMock;
+
+# Minimal scriptable LDAP server and DNS responder for tests of
+# ngx_http_auth_basic_ldap_module.
+#
+# LDAP server answers simple bind, search, StartTLS and unbind for entries
+# given in daemon arguments, appends one line per operation to ldap.log in
+# test directory and reads file ldap.mode before each operation:
+#   down     - close connection without response
+#   busy     - answer with busy result code
+#   delay N  - sleep N seconds before response
+#   stall N  - stop reading for N seconds at first search of connection
+#
+# Search with persistent search control is kept open and answered with
+# entries of DNs appended as lines to file ldap.changes; filter with matching
+# rule of Active Directory LDAP_MATCHING_RULE_IN_CHAIN follows values of its
+# attribute through entries.  TLS is served with certificate and key given
+# in daemon options: from the start (ldaps) or after StartTLS request.
+
+use warnings;
+use strict;
+
+use IO::Socket::INET;
+use IO::Select;
+use IO::Handle;
+use Time::HiRes qw/ sleep /;
+
+our @EXPORT_OK = qw/ ldap_daemon dns_daemon ldap_ops ldap_mode ldap_change /;
+use base 'Exporter';
+
+sub ber_len {
+	my ($len) = @_;
+	return pack('C', $len) if $len < 128;
+	my $b = '';
+	while ($len) { $b = pack('C', $len & 0xff) . $b; $len >>= 8; }
+	return pack('C', 0x80 | length $b) . $b;
+}
+
+sub ber {
+	my ($tag, $value) = @_;
+	return pack('C', $tag) . ber_len(length $value) . $value;
+}
+
+sub ber_int {
+	my ($tag, $n) = @_;
+	my $b = '';
+	do { $b = pack('C', $n & 0xff) . $b; $n >>= 8; } while ($n);
+	$b = "\0" . $b if ord($b) & 0x80;
+	return ber($tag, $b);
+}
+
+sub ber_get {
+	my ($buf) = @_;
+	return unless length $$buf >= 2;
+	my ($tag, $len) = unpack('CC', $$buf);
+	my $off = 2;
+	if ($len & 0x80) {
+		my $n = $len & 0x7f;
+		return unless length $$buf >= $off + $n;
+		$len = 0;
+		$len = ($len << 8) | ord(substr($$buf, $off++, 1)) for 1 .. $n;
+	}
+	return unless length $$buf >= $off + $len;
+	my $value = substr($$buf, $off, $len);
+	substr($$buf, 0, $off + $len) = '';
+	return ($tag, $value);
+}
+
+sub ber_num {
+	my $n = 0;
+	$n = ($n << 8) | $_ for unpack('C*', $_[0]);
+	return $n;
+}
+
+sub ldap_ops {
+	my ($t, $op) = @_;
+	my $log = eval { $t->read_file('ldap.log') } // '';
+	return scalar grep { !defined $op || $_ eq $op } split /\n/, $log;
+}
+
+sub ldap_mode {
+	my ($t, $mode) = @_;
+	$t->write_file('ldap.mode', $mode // '');
+}
+
+sub in_chain {
+	my ($entries, $entry, $attr, $value, $seen) = @_;
+
+	for my $v (@{$entry->{$attr} || []}) {
+		return 1 if lc $v eq lc $value;
+		next if $seen->{lc $v}++ || !$entries->{lc $v};
+		return 1 if in_chain($entries, $entries->{lc $v}, $attr, $value,
+			$seen);
+	}
+	return 0;
+}
+
+sub ldap_change {
+	my ($t, @dns) = @_;
+	open my $fh, '>>', $t->testdir() . '/ldap.changes'
+		or die "Can't open ldap.changes: $!";
+	print $fh map { "$_\n" } @dns;
+	close $fh;
+}
+
+sub filter_match {
+	my ($entries, $entry, $tag, $value) = @_;
+
+	if ($tag == 0xa0 || $tag == 0xa1) {
+		my @r;
+		while (my @f = ber_get(\$value)) {
+			push @r, filter_match($entries, $entry, @f);
+		}
+		return $tag == 0xa0 ? !grep({ !$_ } @r) : !!grep({ $_ } @r);
+	}
+
+	if ($tag == 0xa2) {
+		return !filter_match($entries, $entry, ber_get(\$value));
+	}
+
+	if ($tag == 0xa3) {
+		my (undef, $attr) = ber_get(\$value);
+		my (undef, $assertion) = ber_get(\$value);
+		return !!grep { lc $_ eq lc $assertion } @{$entry->{lc $attr} || []};
+	}
+
+	if ($tag == 0x87) {
+		return lc $value eq 'objectclass' || exists $entry->{lc $value};
+	}
+
+	if ($tag == 0xa9) {
+		my %rule;
+		while (my ($t, $v) = ber_get(\$value)) { $rule{$t} = $v; }
+		my $attr = lc($rule{0x82} // '');
+		return in_chain($entries, $entry, $attr, $rule{0x83} // '', {})
+			if ($rule{0x81} // '') eq '1.2.840.113556.1.4.1941';
+		return !!grep { lc $_ eq lc($rule{0x83} // '') }
+			@{$entry->{$attr} || []};
+	}
+
+	return 1;
+}
+
+sub search_entry {
+	my ($dn, $entry, $attrs) = @_;
+	my $list = '';
+	for my $name (sort keys %$entry) {
+		next if $name eq 'userpassword';
+		next if @$attrs && !grep { $_ eq $name } @$attrs;
+		$list .= ber(0x30, ber(0x04, $name)
+			. ber(0x31, join '', map { ber(0x04, $_) } @{$entry->{$name}}));
+	}
+	return ber(0x64, ber(0x04, $dn) . ber(0x30, $list));
+}
+
+sub search_entries {
+	my ($entries, $req) = @_;
+	my (undef, $base) = ber_get(\$req);
+	ber_get(\$req) for 1 .. 5;
+	my @filter = ber_get(\$req);
+	my (undef, $attrs) = ber_get(\$req);
+	my @attrs;
+	while (my (undef, $attr) = ber_get(\$attrs)) { push @attrs, lc $attr; }
+	@attrs = () if grep { $_ eq '*' } @attrs;
+
+	my @r;
+	for my $dn (sort keys %$entries) {
+		next unless $dn =~ /\Q$base\E$/i;
+		my $entry = $entries->{$dn};
+		next unless filter_match($entries, $entry, @filter);
+		push @r, search_entry($dn, $entry, \@attrs);
+	}
+	return (\@attrs, @r);
+}
+
+sub controls {
+	my ($message) = @_;
+	my (undef, $list) = ber_get(\$message) or return;
+	my @oids;
+	while (my (undef, $control) = ber_get(\$list)) {
+		my (undef, $oid) = ber_get(\$control);
+		push @oids, $oid;
+	}
+	return @oids;
+}
+
+sub psearch_changes {
+	my ($client, $dir, $entries, $psearch) = @_;
+	open my $fh, '<', "$dir/ldap.changes" or return;
+	seek $fh, $psearch->{offset}, 0;
+	while (my $dn = <$fh>) {
+		last unless $dn =~ s/\n$//;
+		$psearch->{offset} = tell $fh;
+		$client->syswrite(ber(0x30, ber_int(0x02, $psearch->{id})
+			. search_entry(lc $dn, $entries->{lc $dn} || {},
+				$psearch->{attrs})));
+	}
+	close $fh;
+}
+
+sub ldap_session {
+	my ($client, $dir, $entries, $opts) = @_;
+	my $buf = '';
+	my ($stalled, $psearch);
+
+	while (1) {
+		my ($tag, $message);
+		while (!(($tag, $message) = ber_get(\$buf))) {
+			if ($psearch) {
+				psearch_changes($client, $dir, $entries, $psearch);
+				next unless IO::Select->new($client)->can_read(0.1);
+			}
+			my $n = $client->sysread($buf, 65536, length $buf);
+			return unless $n;
+		}
+
+		my (undef, $id) = ber_get(\$message);
+		$id = ber_num($id);
+		my ($op, $req) = ber_get(\$message);
+		my @controls = controls($message);
+
+		return if $op == 0x42;
+		next if $op == 0x50;
+
+		my $starttls = $op == 0x77 && $opts->{starttls}
+			&& $req =~ /\Q1.3.6.1.4.1.1466.20037\E/;
+
+		my $mode = '';
+		if (open my $mfh, '<', "$dir/ldap.mode") {
+			$mode = <$mfh> // '';
+			chomp $mode;
+		}
+
+		open my $lfh, '>>', "$dir/ldap.log" or die "Can't open ldap.log: $!";
+		$lfh->autoflush(1);
+		my $name = { 0x60 => 'bind', 0x63 => 'search' }->{$op}
+			// ($starttls ? 'starttls' : 'other');
+		print $lfh "$name\n";
+		close $lfh;
+
+		return if $mode eq 'down';
+		sleep($1) if $mode =~ /^delay\s+([\d.]+)/;
+		sleep($1) if $mode =~ /^stall\s+([\d.]+)/ && $op == 0x63
+			&& !$stalled++;
+
+		my $code = $mode eq 'busy' ? 51 : 0;
+		my @out;
+
+		if ($op == 0x60) {
+			my (undef, $version) = ber_get(\$req);
+			my (undef, $dn) = ber_get(\$req);
+			my (undef, $password) = ber_get(\$req);
+			my $entry = $entries->{lc $dn};
+			$code ||= $entry && $entry->{userpassword}
+				&& $entry->{userpassword}[0] eq $password ? 0 : 49;
+			push @out, ber(0x61, ber_int(0x0a, $code)
+				. ber(0x04, '') . ber(0x04, ''));
+
+		} elsif ($op == 0x63) {
+			my ($attrs, @r) = search_entries($entries, $req);
+			if (!$code && grep { $_ eq '2.16.840.1.113730.3.4.3' } @controls) {
+				$psearch = { id => $id, attrs => $attrs,
+					offset => -s "$dir/ldap.changes" || 0 };
+				next;
+			}
+			push @out, @r unless $code;
+			push @out, ber(0x65, ber_int(0x0a, $code)
+				. ber(0x04, '') . ber(0x04, ''));
+
+		} else {
+			push @out, ber(0x78, ber_int(0x0a, $code || ($starttls ? 0 : 2))
+				. ber(0x04, '') . ber(0x04, ''));
+		}
+
+		$client->syswrite(ber(0x30, ber_int(0x02, $id) . $_)) for @out;
+
+		if ($starttls && !$code) {
+			$client = tls($client, $opts) or return;
+		}
+	}
+}
+
+sub tls {
+	my ($client, $opts) = @_;
+	require IO::Socket::SSL;
+	return IO::Socket::SSL->start_SSL($client,
+		SSL_server => 1,
+		SSL_cert_file => $opts->{cert},
+		SSL_key_file => $opts->{key},
+	);
+}
+
+# ldap_daemon($addr, $dir, { dn => { attr => [ values ] }, ... }, %opts)
+#   ldaps => 1, starttls => 1 with cert => file, key => file
+
+sub ldap_daemon {
+	my ($addr, $dir, $entries, %opts) = @_;
+	my %entries;
+	for my $dn (keys %$entries) {
+		$entries{lc $dn}{lc $_} = $entries->{$dn}{$_}
+			for keys %{$entries->{$dn}};
+	}
+
+	my $server = IO::Socket::INET->new(
+		Proto => 'tcp',
+		LocalAddr => $addr,
+		Listen => 128,
+		Reuse => 1
+	)
+		or die "Can't create listening socket: $!\n";
+
+	local $SIG{CHLD} = 'IGNORE';
+
+	while (my $client = $server->accept()) {
+		$client->autoflush(1);
+		my $pid = fork();
+		die "Can't fork: $!\n" unless defined $pid;
+		if ($pid == 0) {
+			close $server;
+			$client = $opts{ldaps} ? tls($client, \%opts) : $client
+				or exit 0;
+			ldap_session($client, $dir, \%entries, \%opts);
+			exit 0;
+		}
+		close $client;
+	}
+}
+
+# dns_daemon($port, $dir, @addresses) answers A queries with all addresses
+
+sub dns_daemon {
+	my ($port, $dir, @addrs) = @_;
+
+	my $socket = IO::Socket::INET->new(
+		Proto => 'udp',
+		LocalAddr => "127.0.0.1:$port",
+	)
+		or die "Can't create listening socket: $!\n";
+
+	# signal we are ready
+
+	open my $fh, '>', $dir . '/' . $port;
+	close $fh;
+
+	while (1) {
+		my $recv;
+		defined $socket->recv($recv, 65536) or next;
+		my ($id, $flags) = unpack('nn', $recv);
+		my $question = substr($recv, 12);
+		my $pos = 0;
+		while (my $len = ord(substr($question, $pos, 1))) {
+			$pos += $len + 1;
+		}
+		$question = substr($question, 0, $pos + 5);
+		my $type = unpack('n', substr($question, $pos + 1, 2));
+		my @answer = $type == 1 ? @addrs : ();
+
+		my $reply = pack('nnnnnn', $id, 0x8180, 1, scalar @answer, 0, 0)
+			. $question;
+		$reply .= pack('nnnNn', 0xc00c, 1, 1, 3600, 4)
+			. pack('C4', split /\./) for @answer;
+		$socket->send($reply);
+	}
+}
+
+1;